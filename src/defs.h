@@ -42,6 +42,14 @@
 #define MASTER_OR_SINGLE_THREAD (1)
 #endif
 
+#ifdef _OPENMP
+#define CURRENT_THREAD_NUM (omp_get_thread_num())
+#define MAX_THREADS_NUM (omp_get_max_threads())
+#else
+#define CURRENT_THREAD_NUM (0)
+#define MAX_THREADS_NUM (1)
+#endif
+
 #ifdef _OPENMP
 #define OPENMP_ONLY(x) {x;}
 #else
@@ -74,14 +82,38 @@
 #define DEFAULT_VP_SELECT_SCHEME 3
 #define DEFAULT_VP_SELECT_CAND 5
 #define DEFAULT_VP_SELECT_TEST 12
+#define DEFAULT_VP_PIVOTS 4
+#define DEFAULT_PRIM_PIVOTS 0
+#define DEFAULT_VP_FANOUT 2
 #define DEFAULT_NODES_VISITED_LIMIT SIZE_MAX
+#define DEFAULT_MEMORY_LIMIT_MB INFINITY
+#define DEFAULT_CHECKPOINT_INTERVAL 600.0
 #define DEFAULT_THRESHOLD_GINI 0.3
 #define DEFAULT_USEVPTREE false
 #define DEFAULT_USEMST true
-// #define DEFAULT_GNAT_DEGREE 50
-// #define DEFAULT_GNAT_CANDIDATES_TIMES 3
-// #define DEFAULT_GNAT_MIN_DEGREE 2
-// #define DEFAULT_GNAT_MAX_DEGREE 200
+#define DEFAULT_USEBORUVKA false
+#define DEFAULT_USEPIPELINE false
+#define DEFAULT_VP_BEST_FIRST false
+#define DEFAULT_VP_DIAGNOSTICS false
+#define DEFAULT_INDEX HCLUST2_INDEX_VPTREE
+
+#define HCLUST2_INDEX_VPTREE 1
+#define HCLUST2_INDEX_KDTREE 2
+#define HCLUST2_INDEX_GNAT   3
+#define HCLUST2_INDEX_COVERTREE 4
+
+// all the indexes lay the points out in the depth-first order of their
+// trees, so consecutive points are close to each other; each thread
+// processes this many of them in a row in the parallel NN searches
+#define HCLUST2_NN_CHUNK_SIZE 64
+// the pipelined merge checks for a user interrupt every this many iterations
+#define HCLUST2_INTERRUPT_POLL 1024
+// vp-tree leaves are grouped by cluster only if they may be that large
+#define HCLUST2_COMPACT_MIN_LEAF_ELEMS 8
+#define DEFAULT_GNAT_DEGREE 50
+#define DEFAULT_GNAT_CANDIDATES_TIMES 3
+#define DEFAULT_GNAT_MIN_DEGREE 2
+#define DEFAULT_GNAT_MAX_DEGREE 200
 // #define DEFAULT_GNAT_MAX_TIMES_DEGREE 5
 // #define DEFAULT_EXEMPLAR_UPDATE_METHOD 2
 // #define DEFAULT_EXEMPLAR_MAX_LEAVES_ELEMS 32
@@ -76,11 +76,12 @@ PhatDisjointSets::PhatDisjointSets(std::size_t _n) :
    clusterSize(std::vector< std::size_t >(_n, 1)),
    clusterMembers(_n),
    clusterNext(std::vector< std::size_t >(_n)),
-   clusterPrev(std::vector< std::size_t >(_n))
+   clusterPrev(std::vector< std::size_t >(_n)),
+   sizeCount(std::vector< std::size_t >(_n+1, 0))
 {
    clusterCount = _n;
    minClusterSize = 1;
-   minClusterCount = _n;
+   sizeCount[1] = _n;
    for (std::size_t i=0; i<_n; ++i) {
       clusterMembers[i] = (std::size_t*)malloc(sizeof(std::size_t)*1);
       clusterMembers[i][0] = i;
@@ -135,9 +136,7 @@ std::size_t PhatDisjointSets::link(std::size_t x, std::size_t y)
    // clusterMembers[z]->splice(clusterMembers[z]->end(), *(clusterMembers[y])); // O(1)
 
    --clusterCount;
-   if (minClusterCount > 0 && sizex == minClusterSize) minClusterCount--;
-   if (minClusterCount > 0 && sizey == minClusterSize) minClusterCount--;
-   if (minClusterCount == 0) recomputeMinClusterSize();
+   updateMinClusterSize(sizex, sizey);
 
    return z;
 }
@@ -195,28 +194,24 @@ std::size_t PhatDisjointSets::link(std::size_t x, std::size_t y, std::size_t z)
    STOPIFNOT(x == z2 || (!clusterMembers[x] && clusterMembers[z2]));
 #endif
 
-   clusterSize[z2] = clusterSize[x] + clusterSize[y];
+   std::size_t sizex = clusterSize[x];
+   std::size_t sizey = clusterSize[y];
+   clusterSize[z2] = sizex + sizey;
 
    --clusterCount;
+   updateMinClusterSize(sizex, sizey);
    return z2;
 }
 
 
 
-void PhatDisjointSets::recomputeMinClusterSize() {
-   std::size_t start = find_set(0);
-   minClusterSize = getClusterSize(start);
-   minClusterCount = 1;
-   size_t curi = getClusterNext(start);
-   while (curi != start) {
-      std::size_t curSize = getClusterSize(curi);
-      if (curSize == minClusterSize)
-         minClusterCount++;
-      else if (curSize < minClusterSize) {
-         minClusterSize = curSize;
-         minClusterCount = 1;
-      }
-      curi = getClusterNext(curi);
-   }
+void PhatDisjointSets::updateMinClusterSize(std::size_t sizex, std::size_t sizey) {
+   // the clusters never shrink, hence neither does the minimum:
+   // the pointer moves at most n times in overall
+   --sizeCount[sizex];
+   --sizeCount[sizey];
+   ++sizeCount[sizex+sizey];
+   while (sizeCount[minClusterSize] == 0)
+      ++minClusterSize;
 }
 
@@ -67,11 +67,11 @@ private:
    std::vector< std::size_t* > clusterMembers;
    std::vector< std::size_t > clusterNext;
    std::vector< std::size_t > clusterPrev;
+   std::vector< std::size_t > sizeCount; // sizeCount[s] - number of clusters of size s
    std::size_t clusterCount;
    std::size_t minClusterSize;
-   std::size_t minClusterCount;
 
-   void recomputeMinClusterSize();
+   void updateMinClusterSize(std::size_t sizex, std::size_t sizey);
 
 public:
    PhatDisjointSets(std::size_t n);
@@ -0,0 +1,202 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+#include "hclust2_checkpoint.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace grup;
+
+
+#define HCLUST2_CHECKPOINT_MAGIC "GENIECP1"
+
+
+HClustCheckpoint::HClustCheckpoint(const HClustOptions* opts, Distance* distance) :
+      dir(opts->checkpointDir),
+      resumeDir(opts->resume),
+      interval(opts->checkpointInterval),
+      n(distance->getObjectCount()),
+      lastSave(std::chrono::steady_clock::now()),
+      writing(false),
+      failed(false)
+{
+   if (dir.empty() && resumeDir.empty()) return;
+
+   if (n < 2) return;
+   fingerprint.push_back((*distance)(0, n-1));
+   fingerprint.push_back((*distance)(n/3, 2*n/3));
+}
+
+
+HClustCheckpoint::~HClustCheckpoint()
+{
+   join(); // no R API calls here, we might be unwinding the stack
+}
+
+
+void HClustCheckpoint::join()
+{
+   if (writer.joinable()) writer.join();
+}
+
+
+std::string HClustCheckpoint::getFileName(const std::string& dir)
+{
+   return dir + "/genie_checkpoint.bin";
+}
+
+
+HClustCheckpointData& HClustCheckpoint::prepare(size_t phase)
+{
+   join();
+   data.phase = phase;
+   data.n = n;
+   data.fingerprint = fingerprint;
+   data.ints.clear();
+   data.reals.clear();
+   return data;
+}
+
+
+void HClustCheckpoint::save()
+{
+   STOPIFNOT(isEnabled());
+   finish(); // the previous one
+   lastSave = std::chrono::steady_clock::now();
+   writing = true;
+   std::string fname = getFileName(dir);
+   writer = std::thread([this, fname]() {
+      if (!write(fname, data)) failed = true;
+      writing = false;
+   });
+}
+
+
+void HClustCheckpoint::finish()
+{
+   join();
+   if (failed) {
+      Rf_warning("cannot write the checkpoint to %s", dir.c_str());
+      failed = false;
+   }
+}
+
+
+bool HClustCheckpoint::write(const std::string& fname, const HClustCheckpointData& data)
+{
+   // write to a temporary file first, so that a pre-emption
+   // at this point does not damage the previous checkpoint
+   std::string tmpname = fname + ".tmp";
+   FILE* f = fopen(tmpname.c_str(), "wb");
+   if (!f) return false;
+
+   bool ok = (fwrite(HCLUST2_CHECKPOINT_MAGIC, 1, 8, f) == 8);
+   uint64_t header[4] = { (uint64_t)data.phase, (uint64_t)data.n,
+      (uint64_t)data.fingerprint.size(), (uint64_t)data.ints.size() };
+   ok = ok && fwrite(header, sizeof(uint64_t), 4, f) == 4;
+   ok = ok && fwrite(data.fingerprint.data(), sizeof(double),
+      data.fingerprint.size(), f) == data.fingerprint.size();
+   for (size_t k=0; ok && k<data.ints.size(); ++k) {
+      uint64_t len = (uint64_t)data.ints[k].size();
+      ok = fwrite(&len, sizeof(uint64_t), 1, f) == 1 &&
+         fwrite(data.ints[k].data(), sizeof(uint64_t), len, f) == len;
+   }
+   uint64_t nreals = (uint64_t)data.reals.size();
+   ok = ok && fwrite(&nreals, sizeof(uint64_t), 1, f) == 1;
+   for (size_t k=0; ok && k<data.reals.size(); ++k) {
+      uint64_t len = (uint64_t)data.reals[k].size();
+      ok = fwrite(&len, sizeof(uint64_t), 1, f) == 1 &&
+         fwrite(data.reals[k].data(), sizeof(double), len, f) == len;
+   }
+
+   if (fclose(f) != 0) ok = false;
+   if (ok) ok = (rename(tmpname.c_str(), fname.c_str()) == 0);
+   if (!ok) remove(tmpname.c_str());
+   return ok;
+}
+
+
+bool HClustCheckpoint::read(const std::string& fname, HClustCheckpointData& data)
+{
+   FILE* f = fopen(fname.c_str(), "rb");
+   if (!f) return false;
+
+   // the lengths are checked against the file size, so that
+   // a damaged file does not make us allocate tons of memory
+   fseek(f, 0, SEEK_END);
+   long fsize = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   uint64_t avail = (fsize > 0)?(uint64_t)fsize:0;
+
+   char magic[8];
+   uint64_t header[4];
+   bool ok = (fread(magic, 1, 8, f) == 8) && !memcmp(magic, HCLUST2_CHECKPOINT_MAGIC, 8);
+   ok = ok && fread(header, sizeof(uint64_t), 4, f) == 4;
+   ok = ok && header[2] <= avail/sizeof(double) && header[3] <= avail/sizeof(uint64_t);
+   if (ok) {
+      data.phase = (size_t)header[0];
+      data.n = (size_t)header[1];
+      data.fingerprint.resize(header[2]);
+      ok = fread(data.fingerprint.data(), sizeof(double), header[2], f) == header[2];
+      data.ints.resize(header[3]);
+   }
+   for (size_t k=0; ok && k<data.ints.size(); ++k) {
+      uint64_t len;
+      ok = fread(&len, sizeof(uint64_t), 1, f) == 1 && len <= avail/sizeof(uint64_t);
+      if (!ok) break;
+      data.ints[k].resize(len);
+      ok = fread(data.ints[k].data(), sizeof(uint64_t), len, f) == len;
+   }
+   uint64_t nreals = 0;
+   ok = ok && fread(&nreals, sizeof(uint64_t), 1, f) == 1 && nreals <= avail/sizeof(uint64_t);
+   if (ok) data.reals.resize(nreals);
+   for (size_t k=0; ok && k<data.reals.size(); ++k) {
+      uint64_t len;
+      ok = fread(&len, sizeof(uint64_t), 1, f) == 1 && len <= avail/sizeof(double);
+      if (!ok) break;
+      data.reals[k].resize(len);
+      ok = fread(data.reals[k].data(), sizeof(double), len, f) == len;
+   }
+
+   fclose(f);
+   return ok;
+}
+
+
+bool HClustCheckpoint::load(size_t phase, HClustCheckpointData& out)
+{
+   if (resumeDir.empty()) return false;
+
+   std::string fname = getFileName(resumeDir);
+   FILE* f = fopen(fname.c_str(), "rb");
+   if (!f) return false; // nothing to resume from yet, start afresh
+   fclose(f);
+
+   if (!read(fname, out)) {
+      Rf_warning("cannot read the checkpoint from %s. starting afresh", resumeDir.c_str());
+      return false;
+   }
+   if (out.phase != phase || out.n != n || out.fingerprint != fingerprint) {
+      Rf_warning("the checkpoint in %s was written for other data or settings. starting afresh", resumeDir.c_str());
+      return false;
+   }
+
+   MESSAGE_2("[%010.3f] resuming from a checkpoint\n", clock()/(float)CLOCKS_PER_SEC);
+   return true;
+}
@@ -0,0 +1,108 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+#ifndef __HCLUST2_CHECKPOINT_H
+#define __HCLUST2_CHECKPOINT_H
+
+#include "defs.h"
+#include "hclust2_common.h"
+#include "hclust2_distance.h"
+#include <Rcpp.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+
+// the phase a checkpoint was written in; it is resumed in the same phase only
+#define HCLUST2_CHECKPOINT_PRIM    1  /* HClustMSTbasedGini::getMST() */
+#define HCLUST2_CHECKPOINT_MERGE   2  /* HClustNNbasedSingle::computeMerge() */
+#define HCLUST2_CHECKPOINT_BORUVKA 3  /* HClustNNbasedSingle::computeBoruvka() */
+
+
+namespace grup
+{
+
+struct HClustCheckpointData
+{
+   size_t phase;
+   size_t n;
+   std::vector<double> fingerprint; // a few distances, to detect other data
+   std::vector< std::vector<uint64_t> > ints;
+   std::vector< std::vector<double> > reals;
+
+   HClustCheckpointData() : phase(0), n(0) { }
+};
+
+
+class HClustCheckpoint
+{
+private:
+   std::string dir;       // where to write to, "" if disabled
+   std::string resumeDir; // where to read from, "" if not resuming
+   double interval;       // in seconds
+   size_t n;
+   std::vector<double> fingerprint;
+   std::chrono::steady_clock::time_point lastSave;
+
+   // the checkpoints are written by a separate thread so as not to stall
+   // the computations; data is not touched by the other threads until
+   // writing is false again
+   HClustCheckpointData data;
+   std::thread writer;
+   std::atomic<bool> writing;
+   std::atomic<bool> failed;
+
+   static std::string getFileName(const std::string& dir);
+   static bool write(const std::string& fname, const HClustCheckpointData& data);
+   static bool read(const std::string& fname, HClustCheckpointData& data);
+   void join();
+
+public:
+   HClustCheckpoint(const HClustOptions* opts, Distance* distance);
+   ~HClustCheckpoint();
+
+   inline bool isEnabled() const { return !dir.empty(); }
+
+   // whether it is time to write another checkpoint
+   // (and the previous one has already been written)
+   inline bool isDue() const {
+      return isEnabled() && !writing && std::chrono::duration<double>(
+         std::chrono::steady_clock::now()-lastSave).count() >= interval;
+   }
+
+   // returns an empty buffer to be filled and then passed to save()
+   HClustCheckpointData& prepare(size_t phase);
+
+   // writes the prepared buffer asynchronously
+   void save();
+
+   // reads the checkpoint to resume from, returns false if there is none
+   // or it was written in another phase or for other data
+   bool load(size_t phase, HClustCheckpointData& out);
+
+   // waits until the last checkpoint is written
+   void finish();
+
+}; // class HClustCheckpoint
+
+} // namespace grup
+
+#endif
@@ -25,6 +25,10 @@ HClustOptions* NNHeap::opts = NULL;
 
 
 HClustOptions::HClustOptions(Rcpp::RObject control) {
+   degree = DEFAULT_GNAT_DEGREE;
+   candidatesTimes = DEFAULT_GNAT_CANDIDATES_TIMES;
+   minDegree = DEFAULT_GNAT_MIN_DEGREE;
+   maxDegree = DEFAULT_GNAT_MAX_DEGREE;
    maxLeavesElems = DEFAULT_MAX_LEAVES_ELEMS;
    maxNNPrefetch = DEFAULT_MAX_NN_PREFETCH;
    maxNNMerge = DEFAULT_MAX_NN_MERGE;
@@ -33,10 +37,20 @@ HClustOptions::HClustOptions(Rcpp::RObject control) {
    vpSelectScheme = DEFAULT_VP_SELECT_SCHEME;
    vpSelectCand = DEFAULT_VP_SELECT_CAND;
    vpSelectTest = DEFAULT_VP_SELECT_TEST;
+   vpPivots = DEFAULT_VP_PIVOTS;
+   vpFanout = DEFAULT_VP_FANOUT;
+   primPivots = DEFAULT_PRIM_PIVOTS;
    nodesVisitedLimit = DEFAULT_NODES_VISITED_LIMIT;
+   memoryLimitMB = DEFAULT_MEMORY_LIMIT_MB;
+   checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
    thresholdGini = DEFAULT_THRESHOLD_GINI;
    useVpTree = DEFAULT_USEVPTREE;
    useMST = DEFAULT_USEMST;
+   useBoruvka = DEFAULT_USEBORUVKA;
+   usePipeline = DEFAULT_USEPIPELINE;
+   vpBestFirst = DEFAULT_VP_BEST_FIRST;
+   vpDiagnostics = DEFAULT_VP_DIAGNOSTICS;
+   index = DEFAULT_INDEX;
 
    if (!Rf_isNull((SEXP)control)) {
       Rcpp::List control2(control);
@@ -48,6 +62,22 @@ HClustOptions::HClustOptions(Rcpp::RObject control) {
       //    //Rcpp::CharacterVector exemplar = Rcpp::CharacterVector(control2["exemplar"]);
       // }
 
+      if (control2.containsElementNamed("degree")) {
+         degree = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["degree"])[0];
+      }
+
+      if (control2.containsElementNamed("candidatesTimes")) {
+         candidatesTimes = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["candidatesTimes"])[0];
+      }
+
+      if (control2.containsElementNamed("minDegree")) {
+         minDegree = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["minDegree"])[0];
+      }
+
+      if (control2.containsElementNamed("maxDegree")) {
+         maxDegree = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["maxDegree"])[0];
+      }
+
       if (control2.containsElementNamed("maxLeavesElems")) {
          maxLeavesElems = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["maxLeavesElems"])[0];
       }
@@ -80,10 +110,40 @@ HClustOptions::HClustOptions(Rcpp::RObject control) {
          vpSelectTest = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["vpSelectTest"])[0];
       }
 
+      if (control2.containsElementNamed("vpPivots")) {
+         vpPivots = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["vpPivots"])[0];
+      }
+
+      if (control2.containsElementNamed("vpFanout")) {
+         vpFanout = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["vpFanout"])[0];
+      }
+
+      if (control2.containsElementNamed("primPivots")) {
+         primPivots = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["primPivots"])[0];
+      }
+
       if (control2.containsElementNamed("nodesVisitedLimit")) {
          nodesVisitedLimit = (size_t)Rcpp::as<Rcpp::NumericVector>(control2["nodesVisitedLimit"])[0];
       }
 
+      if (control2.containsElementNamed("memoryLimitMB")) {
+         memoryLimitMB = (double)Rcpp::as<Rcpp::NumericVector>(control2["memoryLimitMB"])[0];
+      }
+
+      if (control2.containsElementNamed("checkpointInterval")) {
+         checkpointInterval = (double)Rcpp::as<Rcpp::NumericVector>(control2["checkpointInterval"])[0];
+      }
+
+      if (control2.containsElementNamed("checkpointDir")) {
+         Rcpp::CharacterVector dir = Rcpp::as<Rcpp::CharacterVector>(control2["checkpointDir"]);
+         checkpointDir = std::string(CHAR(STRING_ELT((SEXP)dir, 0)));
+      }
+
+      if (control2.containsElementNamed("resume")) {
+         Rcpp::CharacterVector dir = Rcpp::as<Rcpp::CharacterVector>(control2["resume"]);
+         resume = std::string(CHAR(STRING_ELT((SEXP)dir, 0)));
+      }
+
       if (control2.containsElementNamed("thresholdGini")) {
          thresholdGini = (double)Rcpp::as<Rcpp::NumericVector>(control2["thresholdGini"])[0];
       }
@@ -95,8 +155,57 @@ HClustOptions::HClustOptions(Rcpp::RObject control) {
       if (control2.containsElementNamed("useMST")) {
          useMST = (bool)Rcpp::as<Rcpp::LogicalVector>(control2["useMST"])[0];
       }
+
+      if (control2.containsElementNamed("index")) {
+         // implies useVpTree (i.e., the NN-based engine)
+         Rcpp::CharacterVector index2 = Rcpp::as<Rcpp::CharacterVector>(control2["index"]);
+         const char* index3 = CHAR(STRING_ELT((SEXP)index2, 0));
+         if (!strcmp(index3, "vptree"))
+            index = HCLUST2_INDEX_VPTREE;
+         else if (!strcmp(index3, "kdtree"))
+            index = HCLUST2_INDEX_KDTREE;
+         else if (!strcmp(index3, "gnat"))
+            index = HCLUST2_INDEX_GNAT;
+         else if (!strcmp(index3, "covertree"))
+            index = HCLUST2_INDEX_COVERTREE;
+         else
+            Rcpp::stop("`index` should be one of: \"vptree\", \"kdtree\", \"gnat\", \"covertree\"");
+         useVpTree = true;
+      }
+
+      if (control2.containsElementNamed("useBoruvka")) {
+         useBoruvka = (bool)Rcpp::as<Rcpp::LogicalVector>(control2["useBoruvka"])[0];
+      }
+
+      if (control2.containsElementNamed("usePipeline")) {
+         usePipeline = (bool)Rcpp::as<Rcpp::LogicalVector>(control2["usePipeline"])[0];
+      }
+
+      if (control2.containsElementNamed("vpBestFirst")) {
+         vpBestFirst = (bool)Rcpp::as<Rcpp::LogicalVector>(control2["vpBestFirst"])[0];
+      }
+
+      if (control2.containsElementNamed("vpDiagnostics")) {
+         vpDiagnostics = (bool)Rcpp::as<Rcpp::LogicalVector>(control2["vpDiagnostics"])[0];
+      }
    }
 
+   if (minDegree < 2 || minDegree > 1024) {
+      minDegree = DEFAULT_GNAT_MIN_DEGREE;
+      Rf_warning("wrong minDegree value. using default");
+   }
+   if (maxDegree < minDegree || maxDegree > 1024) {
+      maxDegree = std::max((size_t)DEFAULT_GNAT_MAX_DEGREE, minDegree);
+      Rf_warning("wrong maxDegree value. using default");
+   }
+   if (degree < minDegree || degree > maxDegree) {
+      degree = std::max(minDegree, std::min(maxDegree, (size_t)DEFAULT_GNAT_DEGREE));
+      Rf_warning("wrong degree value. using default");
+   }
+   if (candidatesTimes < 1 || candidatesTimes > 128) {
+      candidatesTimes = DEFAULT_GNAT_CANDIDATES_TIMES;
+      Rf_warning("wrong candidatesTimes value. using default");
+   }
    if (thresholdGini < 0.0 || thresholdGini > 1.0) {
       thresholdGini = DEFAULT_THRESHOLD_GINI;
       Rf_warning("wrong thresholdGini value. using default");
@@ -135,40 +244,87 @@ HClustOptions::HClustOptions(Rcpp::RObject control) {
       vpSelectTest = DEFAULT_VP_SELECT_TEST;
       Rf_warning("wrong vpSelectTest value. using default");
    }
+   if (vpPivots > 32) {
+      vpPivots = DEFAULT_VP_PIVOTS;
+      Rf_warning("wrong vpPivots value. using default");
+   }
+   if (vpFanout < 2 || vpFanout > 16) {
+      vpFanout = DEFAULT_VP_FANOUT;
+      Rf_warning("wrong vpFanout value. using default");
+   }
+   if (primPivots > 32) {
+      primPivots = DEFAULT_PRIM_PIVOTS;
+      Rf_warning("wrong primPivots value. using default");
+   }
    if (nodesVisitedLimit < 1) {
       nodesVisitedLimit = DEFAULT_NODES_VISITED_LIMIT;
       Rf_warning("wrong nodesVisitedLimit value. using default");
    }
+   if (!(memoryLimitMB > 0.0)) {
+      memoryLimitMB = DEFAULT_MEMORY_LIMIT_MB;
+      Rf_warning("wrong memoryLimitMB value. using default");
+   }
+   if (!(checkpointInterval >= 0.0)) {
+      checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
+      Rf_warning("wrong checkpointInterval value. using default");
+   }
+   if (checkpointDir.empty())
+      checkpointDir = resume; // keep on checkpointing where we have resumed from
 }
 
 
 Rcpp::NumericVector HClustOptions::toR() const
 {
-   return Rcpp::NumericVector::create(
-      Rcpp::_["maxLeavesElems"]     = maxLeavesElems,
-      Rcpp::_["maxNNPrefetch"]      = maxNNPrefetch,
-      Rcpp::_["maxNNMerge"]         = maxNNMerge,
-      Rcpp::_["minNNPrefetch"]      = minNNPrefetch,
-      Rcpp::_["minNNMerge"]         = minNNMerge,
-      Rcpp::_["vpSelectScheme"]     = vpSelectScheme,
-      Rcpp::_["vpSelectCand"]       = vpSelectCand,
-      Rcpp::_["vpSelectTest"]       = vpSelectTest,
-      Rcpp::_["nodesVisitedLimit"]  = nodesVisitedLimit,
-      Rcpp::_["thresholdGini"]      = thresholdGini,
-      Rcpp::_["useVpTree"]          = useVpTree,
-      Rcpp::_["useMST"]             = useMST
-   );
+   // NumericVector::create() accepts at most 20 arguments
+   std::vector<double> values;
+   std::vector<std::string> names;
+#define HCLUST2_OPTION_TO_R(name) \
+   values.push_back((double)name); names.push_back(#name);
+
+   HCLUST2_OPTION_TO_R(degree)
+   HCLUST2_OPTION_TO_R(candidatesTimes)
+   HCLUST2_OPTION_TO_R(minDegree)
+   HCLUST2_OPTION_TO_R(maxDegree)
+   HCLUST2_OPTION_TO_R(maxLeavesElems)
+   HCLUST2_OPTION_TO_R(maxNNPrefetch)
+   HCLUST2_OPTION_TO_R(maxNNMerge)
+   HCLUST2_OPTION_TO_R(minNNPrefetch)
+   HCLUST2_OPTION_TO_R(minNNMerge)
+   HCLUST2_OPTION_TO_R(vpSelectScheme)
+   HCLUST2_OPTION_TO_R(vpSelectCand)
+   HCLUST2_OPTION_TO_R(vpSelectTest)
+   HCLUST2_OPTION_TO_R(vpPivots)
+   HCLUST2_OPTION_TO_R(vpFanout)
+   HCLUST2_OPTION_TO_R(primPivots)
+   HCLUST2_OPTION_TO_R(nodesVisitedLimit)
+   HCLUST2_OPTION_TO_R(memoryLimitMB)
+   HCLUST2_OPTION_TO_R(checkpointInterval)
+   HCLUST2_OPTION_TO_R(thresholdGini)
+   HCLUST2_OPTION_TO_R(useVpTree)
+   HCLUST2_OPTION_TO_R(useMST)
+   HCLUST2_OPTION_TO_R(useBoruvka)
+   HCLUST2_OPTION_TO_R(usePipeline)
+   HCLUST2_OPTION_TO_R(vpBestFirst)
+   HCLUST2_OPTION_TO_R(vpDiagnostics)
+   HCLUST2_OPTION_TO_R(index)
+#undef HCLUST2_OPTION_TO_R
+
+   Rcpp::NumericVector out(Rcpp::wrap(values));
+   out.attr("names") = Rcpp::wrap(names);
+   return out;
 }
 
 
 HClustStats::HClustStats() :
    nodeCount(0), leafCount(0), nodeVisit(0), nnCals(0), nnCount(0),
-   medoidOldNew(0), medoidUpdateCount(0) {}
+   medoidOldNew(0), medoidUpdateCount(0), nnCutShort(0), primSkipped(0),
+   maxNNPrefetch(0),
+   diagnostics(R_NilValue) {}
 
 HClustStats::~HClustStats() {
    #if VERBOSE > 0
-   Rprintf("             vp-tree: nodeCount=%.0f, leafCount=%.0f, nodeVisit=%.0f, nnCals=%.0f, nnCount=%.0f, medoidUpdateCount=%.0f, medoidOldNew=%.0f\n",
-      (double)nodeCount, (double)leafCount, (double)nodeVisit, (double)nnCals, (double)nnCount,(double)medoidUpdateCount, (double)medoidOldNew);
+   Rprintf("             vp-tree: nodeCount=%.0f, leafCount=%.0f, nodeVisit=%.0f, nnCals=%.0f, nnCount=%.0f, medoidUpdateCount=%.0f, medoidOldNew=%.0f, nnCutShort=%.0f\n",
+      (double)nodeCount, (double)leafCount, (double)nodeVisit, (double)nnCals, (double)nnCount,(double)medoidUpdateCount, (double)medoidOldNew, (double)nnCutShort);
    #endif
 }
 
@@ -188,6 +344,12 @@ Rcpp::NumericVector HClustStats::toR() const {
       Rcpp::_["medoidUpdateCount"]
          = (medoidUpdateCount>0)?medoidUpdateCount:NA_REAL,
       Rcpp::_["medoidOldNew"]
-         = (medoidOldNew>0)?medoidOldNew:NA_REAL
+         = (medoidOldNew>0)?medoidOldNew:NA_REAL,
+      Rcpp::_["nnCutShort"]
+         = (double)nnCutShort,
+      Rcpp::_["primSkipped"]
+         = (double)primSkipped,
+      Rcpp::_["maxNNPrefetch"]
+         = (maxNNPrefetch>0)?(double)maxNNPrefetch:NA_REAL
    );
 }
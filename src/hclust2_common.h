@@ -28,6 +28,8 @@
 #include <vector>
 #include <queue>
 #include <list>
+#include <algorithm>
+#include <string>
 
 
 namespace grup
@@ -121,6 +123,41 @@ struct HeapHierarchicalItem
 };
 
 
+struct HeapCompactItem
+{
+   // a candidate edge in 12 bytes: the key is the greatest float <= dist;
+   // the top bit of index2 is set if the key is equal to dist
+   uint32_t index1;
+   uint32_t index2;
+   float key;
+
+   HeapCompactItem() :
+      index1(UINT32_MAX), index2(UINT32_MAX), key(INFINITY) {}
+
+   HeapCompactItem(size_t index1, size_t index2, double dist) :
+         index1((uint32_t)index1), index2((uint32_t)index2), key(getKey(dist)) {
+      if ((double)key == dist) this->index2 |= EXACT_BIT;
+   }
+
+   static const uint32_t EXACT_BIT = (uint32_t)1<<31;
+   static const size_t MAX_OBJECTS = EXACT_BIT;
+
+   static inline float getKey(double dist) {
+      float key = (float)dist;
+      if ((double)key > dist) key = std::nextafter(key, -INFINITY);
+      return key;
+   }
+
+   inline size_t getIndex1() const { return index1; }
+   inline size_t getIndex2() const { return index2 & ~EXACT_BIT; }
+   inline bool isExact() const { return (index2 & EXACT_BIT) != 0; }
+
+   inline bool operator<( const HeapCompactItem& o ) const {
+      return key > o.key; // smallest key at the top
+   }
+};
+
+
 // class HclustPriorityQueue {
 // private:
 //    struct BSTNode {
@@ -399,10 +436,10 @@ public:
 
 struct HClustOptions
 {
-//    size_t degree;           // for GNAT
-//    size_t candidatesTimes;  // for GNAT
-//    size_t minDegree;        // for GNAT
-//    size_t maxDegree;        // for GNAT
+   size_t degree;           // for GNAT
+   size_t candidatesTimes;  // for GNAT
+   size_t minDegree;        // for GNAT
+   size_t maxDegree;        // for GNAT
 //    size_t maxTimesDegree;   // for GNAT
    size_t maxLeavesElems;   //
    size_t maxNNPrefetch;    //
@@ -412,10 +449,22 @@ struct HClustOptions
    // std::string exemplar;      //
    bool useVpTree;
    bool useMST;
+   bool useBoruvka;         // NN-based engines: get the MST in Boruvka rounds
+   bool usePipeline;        // NN-based engines: merge while still prefetching
+   bool vpBestFirst;        // vp-tree: visit nodes in the order of increasing lower bounds
+   bool vpDiagnostics;      // vp-tree: gather per-level statistics
+   size_t index;            // NN-based engine's index, HCLUST2_INDEX_*
    size_t vpSelectScheme;   // vp-tree and GNAT
    size_t vpSelectCand;     // for vpSelectScheme == 1
    size_t vpSelectTest;     // for vpSelectScheme == 1
+   size_t vpPivots;         // vp-tree: ancestor pivot distances stored per leaf element
+   size_t vpFanout;         // vp-tree: number of children (shells) of each inner node
+   size_t primPivots;       // Prim: pivots for the triangle inequality-based pruning, 0 to disable
    size_t nodesVisitedLimit;// for single approx
+   double memoryLimitMB;    // NN-based engines: for the candidate edges
+   double checkpointInterval; // seconds between two consecutive checkpoints
+   std::string checkpointDir; // where to write the checkpoints to, "" to disable
+   std::string resume;      // where to read a checkpoint from, "" to start afresh
    double thresholdGini;    // for single approx
    // size_t exemplarUpdateMethod; // exemplar - naive(0) or not naive(1)?
    // size_t maxExemplarLeavesElems; //for exemplars biggers numbers are needed I think
@@ -435,6 +484,10 @@ struct HClustStats
    size_t nnCount;   // how many NNs were obtained in overall
    size_t medoidOldNew; //..how many times it was successful
    size_t medoidUpdateCount; // how many times we calculate d_old and d_new..
+   size_t nnCutShort; // how many NN searches were stopped due to nodesVisitedLimit (always counted)
+   size_t primSkipped; // how many distance computations were pruned by primPivots (always counted)
+   size_t maxNNPrefetch; // NN-based engines: maxNNPrefetch actually used (see memoryLimitMB)
+   Rcpp::RObject diagnostics; // engine-specific, R_NilValue if not gathered
 
    HClustStats();
    ~HClustStats();
@@ -446,15 +499,21 @@ struct HClustStats
 
 
 struct NNHeap {
-   std::priority_queue< HeapNeighborItem > heap;
+   // a max-heap (see std::push_heap) kept in a vector so that its storage
+   // can be reused by subsequent queries; it may grow beyond maxNNPrefetch
+   // elements only if there are ties
+   std::vector< HeapNeighborItem > heap;
    static HClustOptions* opts;
    size_t exemplarsCount;
+   size_t maxNN; // the number of NNs to collect (but the ties), opts->maxNNPrefetch by default
 // #ifdef _OPENMP
 //    omp_lock_t lock;
 // #endif
    NNHeap() :
          heap(),
-         exemplarsCount(0) {
+         exemplarsCount(0),
+         maxNN((opts)?opts->maxNNPrefetch:SIZE_MAX) {
+      if (opts) heap.reserve(opts->maxNNPrefetch+1);
 // #ifdef _OPENMP
 //      omp_init_lock(&lock);
 // #endif
@@ -471,6 +530,12 @@ struct NNHeap {
 
    }
 
+   inline void clear()
+   {
+      heap.clear(); // capacity is retained
+      exemplarsCount = 0;
+   }
+
    inline bool empty()
    {
       return heap.empty();
@@ -478,7 +543,7 @@ struct NNHeap {
 
    inline const HeapNeighborItem& top()
    {
-      return heap.top();
+      return heap.front();
    }
 
    inline const size_t size()
@@ -488,12 +553,14 @@ struct NNHeap {
 
    inline void pop()
    {
-      heap.pop();
+      std::pop_heap(heap.begin(), heap.end());
+      heap.pop_back();
    }
 
    inline void push(const HeapNeighborItem& elem)
    {
-      heap.push(elem);
+      heap.push_back(elem);
+      std::push_heap(heap.begin(), heap.end());
    }
 
    inline void insert(double index, double dist, double& maxR) {
@@ -501,13 +568,15 @@ struct NNHeap {
 // #ifdef _OPENMP
 //       omp_set_lock(&lock);
 // #endif
-      if (heap.size() >= opts->maxNNPrefetch && dist < maxR) {
-         while (!heap.empty() && heap.top().dist == maxR) {
-            heap.pop();
+      if (heap.size() >= maxNN && dist < maxR) {
+         while (!heap.empty() && top().dist == maxR) {
+            pop();
          }
+         // all the ties have gone, so none may be added any more
+         maxR = std::nextafter(maxR, -INFINITY);
       }
-      heap.push( HeapNeighborItem(index, dist) );
-      if (heap.size() >= opts->maxNNPrefetch) maxR = heap.top().dist;
+      push( HeapNeighborItem(index, dist) );
+      if (heap.size() >= maxNN) maxR = top().dist;
 // #ifdef _OPENMP
 //       omp_unset_lock(&lock);
 // #endif
@@ -517,7 +586,7 @@ struct NNHeap {
    // #ifdef _OPENMP
    //       omp_set_lock(&lock);
    // #endif
-      heap.push( HeapNeighborItem(index, dist) );
+      push( HeapNeighborItem(index, dist) );
       if(isExemplar)
       {
          exemplarsCount++;
@@ -526,27 +595,27 @@ struct NNHeap {
       size_t toRemoveExemplarsCount=0;
 
       if (heap.size() >= opts->maxNNPrefetch+1 && dist < maxR) {
-         while (!heap.empty() && heap.top().dist == maxR) {
-            toRemove.push_back(heap.top());
-            if(heap.top().index == ds.find_set(heap.top().index))
+         while (!heap.empty() && top().dist == maxR) {
+            toRemove.push_back(top());
+            if(top().index == ds.find_set(top().index))
             {
                toRemoveExemplarsCount++;
             }
-            heap.pop();
+            pop();
          }
       }
 
       if(toRemoveExemplarsCount == exemplarsCount && exemplarsCount > 0)
       {
          for(auto it = toRemove.begin(); it != toRemove.end(); ++it)
-            heap.push(*it);
+            push(*it);
       }
       else
       {
          exemplarsCount -= toRemoveExemplarsCount;
       }
 
-      if (heap.size() >= opts->maxNNPrefetch && exemplarsCount > 0) maxR = heap.top().dist;
+      if (heap.size() >= opts->maxNNPrefetch && exemplarsCount > 0) maxR = top().dist;
    // #ifdef _OPENMP
    //       omp_unset_lock(&lock);
    // #endif
@@ -554,28 +623,89 @@ struct NNHeap {
 
    inline void fill(std::deque<HeapNeighborItem>& nearestNeighbors) {
       while (!heap.empty()) {
-         nearestNeighbors.push_front(heap.top());
-         heap.pop();
+         nearestNeighbors.push_front(top());
+         pop();
       }
    }
 
    inline void fill(std::list<HeapNeighborItem>& nearestNeighbors) {
       while (!heap.empty()) {
-         nearestNeighbors.push_front(heap.top());
-         heap.pop();
+         nearestNeighbors.push_front(top());
+         pop();
       }
    }
 
    inline void fill(std::priority_queue<HeapNeighborItem, std::vector<HeapNeighborItem>, HeapNeighborItemFromSmallestComparator>& nearestNeighbors)
    {
       while (!heap.empty()) {
-         nearestNeighbors.push(heap.top());
-         heap.pop();
+         nearestNeighbors.push(top());
+         pop();
       }
    }
 };
 
 
+struct NNBestRadii {
+   // a fixed-capacity max-heap of the minNN smallest distances seen so far;
+   // top() is INFINITY until minNN distances have been inserted
+   std::vector<double> heap;
+   size_t k;
+
+   NNBestRadii(size_t capacity) :
+         heap(std::max(capacity, (size_t)1), INFINITY),
+         k(std::max(capacity, (size_t)1)) { }
+
+   inline void reset(size_t minNN)
+   {
+      STOPIFNOT(minNN >= 1 && minNN <= heap.size())
+      k = minNN;
+      std::fill(heap.begin(), heap.begin()+k, INFINITY);
+   }
+
+   inline double top() const
+   {
+      return heap[0];
+   }
+
+   inline void replaceTop(double dist)
+   {
+      // sift down
+      size_t i = 0;
+      while (true) {
+         size_t j = 2*i+1;
+         if (j >= k) break;
+         if (j+1 < k && heap[j+1] > heap[j]) ++j;
+         if (heap[j] <= dist) break;
+         heap[i] = heap[j];
+         i = j;
+      }
+      heap[i] = dist;
+   }
+};
+
+
+struct NNSearchContext {
+   // per-thread storage reused by all the NN queries so that they do not
+   // need to allocate any memory
+   NNHeap nnheap;
+   NNBestRadii bestR;
+   size_t nodesVisitedLimit; // SIZE_MAX for an exact search
+   bool cutShort;            // set if the search was stopped due to the above
+   size_t lowest;            // the smallest index a neighbour may have
+   size_t minNN;             // the number of NNs that must be found
+   std::vector<HeapCompactItem> pqbuf;           // buffered pushes: prefetched edges
+   std::vector<HeapHierarchicalItem> pqbufExact; // buffered pushes: the other items
+
+   NNSearchContext(HClustOptions* opts) :
+         nnheap(),
+         bestR(std::max(opts->minNNPrefetch, opts->minNNMerge)),
+         nodesVisitedLimit(SIZE_MAX), cutShort(false),
+         lowest(0), minNN(opts->minNNMerge), pqbuf(), pqbufExact() { }
+
+   virtual ~NNSearchContext() { }
+};
+
+
 struct DistanceComparator
 {
    size_t index;
@@ -0,0 +1,284 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+
+#include "hclust2_covertree_single.h"
+#include <climits>
+#include <cmath>
+
+using namespace grup;
+
+
+// constructor (OK, we all know what this is, but I label it for faster in-code search)
+HClustCoverTreeSingle::HClustCoverTreeSingle(Distance* dist, HClustOptions* opts) :
+      HClustNNbasedSingle(dist, opts),
+      root(NULL),
+      depth(0)
+{
+   MESSAGE_2("[%010.3f] building cover tree\n", clock()/(float)CLOCKS_PER_SEC);
+
+   // indices is a random permutation, which is good for the insertion order
+   for (size_t i=0; i<n; ++i)
+      insert(indices[i]);
+   updatePositions();
+}
+
+
+HClustCoverTreeSingle::~HClustCoverTreeSingle() {
+   if(root) delete root;
+}
+
+
+// the smallest level whose covering radius is >= dist > 0
+static inline int coveringLevel(double dist)
+{
+   int level = (int)std::ceil(std::log2(dist));
+   while (std::ldexp(1.0, level) < dist) ++level; // rounding errors
+   return level;
+}
+
+
+void HClustCoverTreeSingle::insert(size_t object)
+{
+   // invariants (for each node p at level i, other than duplicates):
+   // covering - p's children are at level i-1 and within 2^i from p;
+   // separation - p's children are more than 2^(i-1) from each other;
+   // nesting holds implicitly, as a node stands for its point at all
+   // the levels below its own; hence the depth is O(log aspect ratio)
+   // and the fan-out is bounded by the data's expansion constant
+#ifdef GENERATE_STATS
+   ++stats.nodeCount;
+#endif
+   if (!root) {
+      root = new HClustCoverTreeSingleNode(object, INT_MIN);
+      return;
+   }
+
+   double dist = (*distance)(root->object, object);
+   if (root->children.empty() || root->level == INT_MIN) {
+      // the root has no children but its duplicates: any level will do
+      if (dist > 0.0) root->level = coveringLevel(dist);
+   }
+   else if (dist > root->covdist()) {
+      // raise the root: a leaf goes one level above it (it is within
+      // 2^(level+1) from the root as the covering radii form
+      // a geometric series) until the new point can become the root
+      while (dist > 2.0*root->covdist()) {
+         HClustCoverTreeSingleNode* parent = NULL;
+         HClustCoverTreeSingleNode* leaf = root;
+         while (!leaf->children.empty()) {
+            parent = leaf;
+            leaf = leaf->children.back();
+         }
+         parent->children.pop_back();
+         parent->sameCluster = false;
+
+         leaf->parentdist = 0.0;
+         leaf->level = root->level+1;
+         root->parentdist = (*distance)(leaf->object, root->object);
+         leaf->maxdist = root->parentdist+root->maxdist; // an upper bound
+         leaf->children.push_back(root);
+         leaf->sameCluster = false;
+         root = leaf;
+         dist = (*distance)(root->object, object);
+      }
+
+      if (dist > root->covdist()) {
+         HClustCoverTreeSingleNode* node = new HClustCoverTreeSingleNode(object, root->level+1);
+         root->parentdist = dist;
+         node->maxdist = dist+root->maxdist;
+         node->children.push_back(root);
+         root = node;
+         return;
+      }
+   }
+
+   HClustCoverTreeSingleNode* node = root;
+   while (true) {
+      if (dist > node->maxdist) node->maxdist = dist;
+      if (dist == 0.0) {
+         // a duplicate: a leaf below its twin, at level -Inf
+         // so that no other point is inserted below it
+         node->children.push_back(new HClustCoverTreeSingleNode(object, INT_MIN, 0.0));
+         node->sameCluster = false;
+         return;
+      }
+
+      // descend to the nearest child whose ball covers the point
+      HClustCoverTreeSingleNode* best = NULL;
+      double bestDist = INFINITY;
+      for (size_t j=0; j<node->children.size(); ++j) {
+         HClustCoverTreeSingleNode* child = node->children[j];
+         double curDist = (*distance)(child->object, object);
+         if (curDist <= child->covdist() && curDist < bestDist) {
+            best = child;
+            bestDist = curDist;
+         }
+      }
+      if (!best) break;
+      node = best;
+      dist = bestDist;
+   }
+
+   // no child covers the point, so it is more than 2^(level-1) from all of them
+   node->children.push_back(new HClustCoverTreeSingleNode(object, node->level-1, dist));
+   node->sameCluster = false;
+}
+
+
+void HClustCoverTreeSingle::updatePositions()
+{
+   // depth-first pre-order, so that each subtree occupies
+   // a contiguous range of positions
+   STOPIFNOT(root != NULL);
+   std::vector< std::pair<HClustCoverTreeSingleNode*, size_t> > stack;
+   std::vector<HClustCoverTreeSingleNode*> order;
+   order.reserve(n);
+   depth = 0;
+   stack.push_back(std::make_pair(root, (size_t)0));
+   while (!stack.empty()) {
+      HClustCoverTreeSingleNode* node = stack.back().first;
+      size_t level = stack.back().second;
+      stack.pop_back();
+      if (level > depth) depth = level;
+
+      node->pos = order.size();
+      indices[node->pos] = node->object;
+      order.push_back(node);
+      for (size_t j=node->children.size(); j>0; --j)
+         stack.push_back(std::make_pair(node->children[j-1], level+1));
+   }
+   STOPIFNOT(order.size() == n);
+
+   // maxindex: in reverse pre-order, children go before their parents
+   for (size_t i=order.size(); i>0; --i) {
+      HClustCoverTreeSingleNode* node = order[i-1];
+      node->maxindex = node->pos;
+      for (size_t j=0; j<node->children.size(); ++j)
+         if (node->children[j]->maxindex > node->maxindex)
+            node->maxindex = node->children[j]->maxindex;
+      node->sameCluster = node->children.empty();
+   #ifdef GENERATE_STATS
+      if (node->children.empty()) ++stats.leafCount;
+   #endif
+   }
+}
+
+
+void HClustCoverTreeSingle::getNearestNeighborsFromMinRadius(
+   size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx)
+{
+   // search within (minR, maxR]
+   // depth-first, the nearest child first; the distances to a node's
+   // children are computed when the node is expanded (unless they
+   // can be pruned based on the distances to their parent);
+   // the sameCluster flags are checked before that too
+   std::vector<HClustCoverTreeSingleStackItem>& stack =
+      static_cast<HClustCoverTreeSingleContext&>(ctx).stack;
+   NNBestRadii& bestR = ctx.bestR;
+   NNHeap& nnheap = ctx.nnheap;
+   bestR.reset(ctx.minNN);
+   size_t lowest = ctx.lowest;
+   double maxR = INFINITY;
+   size_t nodesVisited = 0;
+
+   stack.clear(); // capacity is retained
+   if (root->maxindex < lowest)
+      return;
+   if (!prefetch) {
+      updateSameClusterFlag(root);
+      if (root->sameCluster && clusterIndex == findCluster(root->pos))
+         return;
+   }
+   double rootDist = (*distance)(indices[index], root->object);
+   stack.push_back(HClustCoverTreeSingleStackItem(root, rootDist,
+      std::max(0.0, rootDist-root->maxdist)));
+   while (!stack.empty()) {
+      HClustCoverTreeSingleStackItem cur = stack.back();
+      stack.pop_back();
+      HClustCoverTreeSingleNode* node = cur.node;
+
+      if (cur.lb > maxR)
+         continue;
+
+      if (bestR.top() < cur.lb) {
+         // enough neighbors closer than anything in this subtree;
+         // drop the ones that could be beaten by its elements
+         while (!nnheap.empty() && nnheap.top().dist >= cur.lb)
+            nnheap.pop();
+         maxR = std::nextafter(cur.lb, -INFINITY);
+         continue;
+      }
+
+      if (++nodesVisited > ctx.nodesVisitedLimit) {
+         ctx.cutShort = true;
+         break;
+      }
+
+      #ifdef GENERATE_STATS
+      #ifdef _OPENMP
+      #pragma omp atomic
+      #endif
+         ++stats.nodeVisit;
+      #endif
+
+      if (lowest <= node->pos && cur.dist <= maxR && cur.dist > minR &&
+            (prefetch || findCluster(node->pos) != clusterIndex)) {
+         if (cur.dist < bestR.top()) bestR.replaceTop(cur.dist);
+         nnheap.insert(node->pos, cur.dist, maxR);
+      }
+
+      size_t from = stack.size();
+      for (size_t j=0; j<node->children.size(); ++j) {
+         HClustCoverTreeSingleNode* child = node->children[j];
+         if (child->maxindex < lowest) continue;
+         if (!prefetch) {
+            updateSameClusterFlag(child);
+            if (child->sameCluster && clusterIndex == findCluster(child->pos))
+               continue;
+         }
+         // first try to prune w/o computing the distance to the child
+         if (std::fabs(cur.dist-child->parentdist)-child->maxdist > maxR) continue;
+         if (cur.dist+child->parentdist+child->maxdist <= minR) continue;
+         double dist = (*distance)(indices[index], child->object); // the slow part
+         if (dist + child->maxdist <= minR) continue;
+         double lb = std::max(0.0, dist-child->maxdist);
+         if (lb > maxR) continue;
+         stack.push_back(HClustCoverTreeSingleStackItem(child, dist, lb));
+      }
+      std::sort(stack.begin()+from, stack.end());
+   }
+}
+
+
+void HClustCoverTreeSingle::updateSameClusterFlag(HClustCoverTreeSingleNode* node)
+{
+   if (prefetch || node->sameCluster) return;
+
+   for (size_t j=0; j<node->children.size(); ++j)
+      if (!node->children[j]->sameCluster)
+         return;
+
+   // otherwise check if node->sameCluster flag needs updating
+   size_t commonCluster = findCluster(node->pos);
+   for (size_t j=0; j<node->children.size(); ++j)
+      if (findCluster(node->children[j]->pos) != commonCluster)
+         return; // not ready yet
+   node->sameCluster = true;
+}
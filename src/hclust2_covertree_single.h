@@ -0,0 +1,117 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+#ifndef __HCLUST2_COVERTREE_SINGLE_H
+#define __HCLUST2_COVERTREE_SINGLE_H
+
+
+
+// ************************************************************************
+
+#include "hclust2_nnbased_single.h"
+
+
+namespace grup
+{
+
+// a simplified cover tree (one node per point), see M. Izbicki, C.R. Shelton,
+// "Faster cover trees", ICML'15, pp. 1162-1170, and HClustCoverTreeSingle::insert;
+// each subtree's elements occupy a contiguous range of positions, indices[pos..maxindex]
+struct HClustCoverTreeSingleNode
+{
+   size_t object;  // index of the point in the Distance object
+   size_t pos;     // position in indices, see HClustCoverTreeSingle::updatePositions
+   int level;      // covering radius is 2^level, INT_MIN for duplicates
+   double maxdist; // an upper bound for the distances to the descendants
+   double parentdist; // distance to the parent's point
+   bool sameCluster;
+   size_t maxindex;
+   std::vector<HClustCoverTreeSingleNode*> children;
+
+   HClustCoverTreeSingleNode(size_t object, int level, double parentdist=0.0) :
+         object(object), pos(SIZE_MAX), level(level), maxdist(0.0),
+         parentdist(parentdist), sameCluster(false), maxindex(SIZE_MAX), children()  { }
+
+   ~HClustCoverTreeSingleNode() {
+      for (size_t j=0; j<children.size(); ++j)
+         delete children[j];
+   }
+
+   inline double covdist() const { return std::ldexp(1.0, level); }
+};
+
+
+struct HClustCoverTreeSingleStackItem
+{
+   HClustCoverTreeSingleNode* node;
+   double dist; // distance between the query point and node's point
+   double lb;   // lower bound for the distance between the query and node's elements
+
+   HClustCoverTreeSingleStackItem(HClustCoverTreeSingleNode* node, double dist, double lb) :
+         node(node), dist(dist), lb(lb) { }
+
+   inline bool operator<( const HClustCoverTreeSingleStackItem& o ) const {
+      return lb > o.lb; // std::sort will put the nearest node last
+   }
+};
+
+
+struct HClustCoverTreeSingleContext : public NNSearchContext
+{
+   std::vector<HClustCoverTreeSingleStackItem> stack; // explicit traversal stack
+
+   HClustCoverTreeSingleContext(HClustOptions* opts, size_t depth) :
+         NNSearchContext(opts),
+         stack() {
+      stack.reserve(4*(depth+1));
+   }
+};
+
+
+class HClustCoverTreeSingle : public HClustNNbasedSingle
+{
+protected:
+   HClustCoverTreeSingleNode* root;
+   size_t depth;
+
+   // the tree is built by inserting the points one by one (in the constructor
+   // only: the per-point state in HClustNNbasedSingle is allocated once);
+   // updatePositions() must be called before the first search
+   void insert(size_t object);
+   void updatePositions();
+
+   virtual NNSearchContext* createSearchContext() {
+      return new HClustCoverTreeSingleContext(opts, depth);
+   }
+
+   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx);
+
+   void updateSameClusterFlag(HClustCoverTreeSingleNode* node);
+
+public:
+
+   HClustCoverTreeSingle(Distance* dist, HClustOptions* opts);
+   ~HClustCoverTreeSingle();
+
+}; // class
+
+} // namespace grup
+
+
+#endif
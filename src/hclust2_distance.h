@@ -138,6 +138,9 @@ public:
 
    GenericMatrixDistance(const Rcpp::NumericMatrix& points);
 
+   inline const double* getItems() const { return items; } // row-major, n*m
+   inline size_t getDim() const { return m; }
+
    virtual ~GenericMatrixDistance() {
 // #if VERBOSE > 5
 //       Rprintf("[%010.3f] destroying distance object\n", clock()/(float)CLOCKS_PER_SEC);
@@ -0,0 +1,315 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+
+#include "hclust2_gnat_single.h"
+
+using namespace grup;
+
+
+struct GnatBranchComparator
+{
+   const std::vector<double>& lb;
+
+   GnatBranchComparator(const std::vector<double>& lb) : lb(lb) { }
+
+   inline bool operator()(size_t a, size_t b) const {
+      return lb[a] > lb[b]; // the nearest branch goes last
+   }
+};
+
+
+// constructor (OK, we all know what this is, but I label it for faster in-code search)
+HClustGnatSingle::HClustGnatSingle(Distance* dist, HClustOptions* opts) :
+      HClustNNbasedSingle(dist, opts),
+      root(NULL),
+      depth(0)
+{
+   MESSAGE_2("[%010.3f] building GNAT\n", clock()/(float)CLOCKS_PER_SEC);
+
+   std::vector<double> distances(n);
+   std::vector<size_t> owners(n);
+   root = buildFromPoints(0, n, opts->degree, distances, owners);
+}
+
+
+HClustGnatSingle::~HClustGnatSingle() {
+   if(root) delete root;
+}
+
+
+void HClustGnatSingle::chooseSplitPoints(size_t left, size_t right,
+   size_t degree, std::vector<double>& distances)
+{
+   // greedy farthest-first selection among candidatesTimes*degree random points;
+   // the split points are moved to indices[left..left+degree-1]
+   size_t cand = std::min(right-left, opts->candidatesTimes*degree);
+   for (size_t i=left; i<left+cand; ++i)
+      std::swap(indices[i], indices[i+(size_t)(unif_rand()*(right-i))]);
+
+   for (size_t i=left+1; i<left+cand; ++i)
+      distances[indices[i]] = INFINITY;
+
+   for (size_t s=left+1; s<left+degree; ++s) {
+      size_t last = indices[s-1];
+      size_t bestIndex = s;
+      double bestDist  = -INFINITY;
+      for (size_t i=s; i<left+cand; ++i) {
+         double curDist = (*distance)(last, indices[i]);
+         if (curDist < distances[indices[i]])
+            distances[indices[i]] = curDist;
+         if (distances[indices[i]] > bestDist) {
+            bestDist = distances[indices[i]];
+            bestIndex = i;
+         }
+      }
+      std::swap(indices[s], indices[bestIndex]);
+   }
+}
+
+
+HClustGnatSingleNode* HClustGnatSingle::buildFromPoints(size_t left,
+   size_t right, size_t degree, std::vector<double>& distances,
+   std::vector<size_t>& owners, size_t level)
+{
+#ifdef GENERATE_STATS
+   ++stats.nodeCount;
+#endif
+   if (level > depth) depth = level;
+   HClustGnatSingleNode* node = new HClustGnatSingleNode(left, right);
+   if (right - left <= opts->maxLeavesElems)
+   {
+   #ifdef GENERATE_STATS
+      ++stats.leafCount;
+   #endif
+      return node;
+   }
+
+   size_t k = std::min(degree, right-left);
+   chooseSplitPoints(left, right, k, distances);
+   node->degree = k;
+   node->ranges = new double[2*k*k];
+   for (size_t i=0; i<k*k; ++i) {
+      node->ranges[2*i+0] = INFINITY;
+      node->ranges[2*i+1] = -INFINITY;
+   }
+
+   for (size_t i=0; i<k; ++i) {
+      double* r = node->ranges+2*(i*k+i);
+      r[0] = 0.0; r[1] = 0.0;
+      for (size_t j=i+1; j<k; ++j) {
+         double d = (*distance)(indices[left+i], indices[left+j]);
+         r = node->ranges+2*(i*k+j);
+         r[0] = std::min(r[0], d); r[1] = std::max(r[1], d);
+         r = node->ranges+2*(j*k+i);
+         r[0] = std::min(r[0], d); r[1] = std::max(r[1], d);
+      }
+   }
+
+   // assign each remaining point to its nearest split point
+   std::vector<double> dx(k);
+   std::vector<size_t> counts(k, 0);
+   for (size_t p=left+k; p<right; ++p) {
+      size_t owner = 0;
+      for (size_t i=0; i<k; ++i) {
+         dx[i] = (*distance)(indices[left+i], indices[p]);
+         if (dx[i] < dx[owner]) owner = i;
+      }
+      for (size_t i=0; i<k; ++i) {
+         double* r = node->ranges+2*(i*k+owner);
+         r[0] = std::min(r[0], dx[i]); r[1] = std::max(r[1], dx[i]);
+      }
+      owners[indices[p]] = owner;
+      ++counts[owner];
+   }
+
+   // group the points by their owners (counting sort)
+   std::vector<size_t> starts(k+1, left+k);
+   for (size_t j=0; j<k; ++j)
+      starts[j+1] = starts[j]+counts[j];
+   std::vector<size_t> tmp(indices.begin()+left+k, indices.begin()+right);
+   std::vector<size_t> cur(starts.begin(), starts.end()-1);
+   for (size_t p=0; p<tmp.size(); ++p)
+      indices[cur[owners[tmp[p]]]++] = tmp[p];
+
+   // the degree of a child is proportional to the number of its elements
+   node->children.resize(k, NULL);
+   for (size_t j=0; j<k; ++j) {
+      if (counts[j] == 0) continue;
+      size_t childDegree = (size_t)(k*k*(double)counts[j]/(double)(right-left-k));
+      childDegree = std::max(opts->minDegree, std::min(opts->maxDegree, childDegree));
+      node->children[j] = buildFromPoints(starts[j], starts[j+1], childDegree,
+         distances, owners, level+1);
+   }
+
+   return node;
+}
+
+
+void HClustGnatSingle::getNearestNeighborsFromMinRadiusLeaf(
+   HClustGnatSingleNode* node, size_t index, size_t lowest,
+   size_t clusterIndex, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap)
+{
+   STOPIFNOT(node->degree == 0);
+   if (!prefetch && !node->sameCluster) {
+      size_t commonCluster = findCluster(node->left);
+      for (size_t i=node->left; i<node->right; ++i) {
+         size_t currentCluster = findCluster(i);
+         if (currentCluster != commonCluster) commonCluster = SIZE_MAX;
+         if (currentCluster == clusterIndex) continue;
+         if (i < lowest) continue;
+         double dist2 = (*distance)(indices[index], indices[i]); // the slow part
+         if (dist2 > maxR || dist2 <= minR) continue;
+         if (dist2 < bestR.top()) bestR.replaceTop(dist2);
+
+         nnheap.insert(i, dist2, maxR);
+      }
+      if (commonCluster != SIZE_MAX)
+         node->sameCluster = true; // set to true (btw, may be true already)
+   }
+   else /* node->sameCluster */ {
+      for (size_t i=node->left; i<node->right; ++i) {
+         if (i < lowest) continue;
+         double dist2 = (*distance)(indices[index], indices[i]); // the slow part
+         if (dist2 > maxR || dist2 <= minR) continue;
+         if (dist2 < bestR.top()) bestR.replaceTop(dist2);
+
+         nnheap.insert(i, dist2, maxR);
+      }
+   }
+}
+
+
+void HClustGnatSingle::getNearestNeighborsFromMinRadius(
+   size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx)
+{
+   // search within (minR, maxR]
+   // depth-first, the nearest branch first; the distances to a node's
+   // split points and the distance range tables let us skip whole branches
+   HClustGnatSingleContext& gctx = static_cast<HClustGnatSingleContext&>(ctx);
+   std::vector<HClustGnatSingleStackItem>& stack = gctx.stack;
+   std::vector<double>& lb = gctx.lb;
+   std::vector<size_t>& order = gctx.order;
+   NNBestRadii& bestR = ctx.bestR;
+   NNHeap& nnheap = ctx.nnheap;
+   bestR.reset(ctx.minNN);
+   size_t lowest = ctx.lowest;
+   double maxR = INFINITY;
+   size_t nodesVisited = 0;
+
+   stack.clear(); // capacity is retained
+   if (lowest <= root->maxindex)
+      stack.push_back(HClustGnatSingleStackItem(root, 0.0));
+   while (!stack.empty()) {
+      HClustGnatSingleStackItem cur = stack.back();
+      stack.pop_back();
+      HClustGnatSingleNode* node = cur.node;
+
+      if (cur.lb > maxR)
+         continue;
+
+      if (bestR.top() < cur.lb) {
+         // enough neighbors closer than anything in this subtree;
+         // drop the ones that could be beaten by its elements
+         while (!nnheap.empty() && nnheap.top().dist >= cur.lb)
+            nnheap.pop();
+         maxR = std::nextafter(cur.lb, -INFINITY);
+         continue;
+      }
+
+      if (++nodesVisited > ctx.nodesVisitedLimit) {
+         ctx.cutShort = true;
+         break;
+      }
+
+      #ifdef GENERATE_STATS
+      #ifdef _OPENMP
+      #pragma omp atomic
+      #endif
+         ++stats.nodeVisit;
+      #endif
+
+      if (!prefetch) {
+         updateSameClusterFlag(node);
+         if (node->sameCluster && clusterIndex == findCluster(node->left))
+            continue;
+      }
+
+      if (node->degree == 0) { // leaf
+         getNearestNeighborsFromMinRadiusLeaf(node, index, lowest, clusterIndex,
+            minR, bestR, maxR, nnheap);
+         continue;
+      }
+
+      size_t k = node->degree;
+      for (size_t j=0; j<k; ++j) {
+         bool alive = (lowest <= node->left+j) ||
+            (node->children[j] && lowest <= node->children[j]->maxindex);
+         lb[j] = (alive)?cur.lb:INFINITY;
+      }
+
+      for (size_t i=0; i<k; ++i) {
+         if (lb[i] > maxR) continue; // pruned
+
+         size_t vp = node->left+i;
+         double dist = (*distance)(indices[index], indices[vp]); // the slow part
+         if (lowest <= vp && dist <= maxR && dist > minR &&
+               (prefetch || findCluster(vp) != clusterIndex)) {
+            if (dist < bestR.top()) bestR.replaceTop(dist);
+            nnheap.insert(vp, dist, maxR);
+         }
+
+         const double* r = node->ranges+2*(i*k);
+         for (size_t j=0; j<k; ++j) {
+            if (lb[j] > maxR) continue; // pruned
+            if (dist + r[2*j+1] <= minR) { lb[j] = INFINITY; continue; }
+            lb[j] = std::max(lb[j], std::max(r[2*j+0]-dist, dist-r[2*j+1]));
+         }
+      }
+
+      order.clear();
+      for (size_t j=0; j<k; ++j) {
+         if (lb[j] <= maxR && node->children[j] && lowest <= node->children[j]->maxindex)
+            order.push_back(j);
+      }
+      std::sort(order.begin(), order.end(), GnatBranchComparator(lb));
+      for (size_t j=0; j<order.size(); ++j)
+         stack.push_back(HClustGnatSingleStackItem(node->children[order[j]], lb[order[j]]));
+   }
+}
+
+
+void HClustGnatSingle::updateSameClusterFlag(HClustGnatSingleNode* node)
+{
+   if (prefetch || node->sameCluster || node->degree == 0) return;
+
+   for (size_t j=0; j<node->degree; ++j)
+      if (node->children[j] && !node->children[j]->sameCluster)
+         return;
+
+   // otherwise check if node->sameCluster flag needs updating
+   size_t commonCluster = findCluster(node->left);
+   for (size_t j=0; j<node->degree; ++j) {
+      if (findCluster(node->left+j) != commonCluster)
+         return; // not ready yet
+      if (node->children[j] && findCluster(node->children[j]->left) != commonCluster)
+         return; // not ready yet
+   }
+   node->sameCluster = true;
+}
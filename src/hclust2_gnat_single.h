@@ -0,0 +1,113 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+#ifndef __HCLUST2_GNAT_SINGLE_H
+#define __HCLUST2_GNAT_SINGLE_H
+
+
+
+// ************************************************************************
+
+#include "hclust2_nnbased_single.h"
+
+
+namespace grup
+{
+
+// Geometric Near-neighbor Access Tree, see S. Brin,
+// "Near neighbor search in large metric spaces", VLDB'95, pp. 574-584.
+struct HClustGnatSingleNode
+{
+   size_t left;    // elements are indices[left..right-1]
+   size_t right;
+   size_t degree;  // split points are indices[left..left+degree-1]; 0 for leaves
+   double* ranges; // [min,max] of d(split_i, x), x in {split_j} + child_j: ranges[2*(i*degree+j)+0/1]
+   bool sameCluster;
+   size_t maxindex;
+   std::vector<struct HClustGnatSingleNode*> children; // child_j may be NULL
+
+   HClustGnatSingleNode(size_t left, size_t right) :
+         left(left), right(right), degree(0), ranges(NULL),
+         sameCluster(false), maxindex(right-1), children()  { }
+
+   ~HClustGnatSingleNode() {
+      if (ranges) delete [] ranges;
+      for (size_t j=0; j<children.size(); ++j)
+         if (children[j]) delete children[j];
+   }
+};
+
+
+struct HClustGnatSingleStackItem
+{
+   HClustGnatSingleNode* node;
+   double lb; // lower bound for the distance between the query and node's elements
+
+   HClustGnatSingleStackItem(HClustGnatSingleNode* node, double lb) :
+         node(node), lb(lb) { }
+};
+
+
+struct HClustGnatSingleContext : public NNSearchContext
+{
+   std::vector<HClustGnatSingleStackItem> stack; // explicit traversal stack
+   std::vector<double> lb;   // lower bounds for the current node's branches
+   std::vector<size_t> order; // branches to visit
+
+   HClustGnatSingleContext(HClustOptions* opts, size_t depth) :
+         NNSearchContext(opts),
+         stack(), lb(std::max(opts->degree, opts->maxDegree)), order() {
+      stack.reserve((depth+1)*lb.size());
+      order.reserve(lb.size());
+   }
+};
+
+
+class HClustGnatSingle : public HClustNNbasedSingle
+{
+protected:
+   HClustGnatSingleNode* root;
+   size_t depth;
+
+   void chooseSplitPoints(size_t left, size_t right, size_t degree, std::vector<double>& distances);
+   HClustGnatSingleNode* buildFromPoints(size_t left, size_t right, size_t degree,
+      std::vector<double>& distances, std::vector<size_t>& owners, size_t level=0);
+
+   void getNearestNeighborsFromMinRadiusLeaf(HClustGnatSingleNode* node,
+      size_t index, size_t lowest, size_t clusterIndex, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap);
+
+   virtual NNSearchContext* createSearchContext() {
+      return new HClustGnatSingleContext(opts, depth);
+   }
+
+   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx);
+
+   void updateSameClusterFlag(HClustGnatSingleNode* node);
+
+public:
+
+   HClustGnatSingle(Distance* dist, HClustOptions* opts);
+   ~HClustGnatSingle();
+
+}; // class
+
+} // namespace grup
+
+
+#endif
@@ -0,0 +1,270 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+
+#include "hclust2_kdtree_single.h"
+
+using namespace grup;
+
+
+struct KdTreeCoordComparator
+{
+   const double* items;
+   size_t m;
+   size_t dim;
+
+   KdTreeCoordComparator(const double* items, size_t m, size_t dim) :
+      items(items), m(m), dim(dim) { }
+
+   inline bool operator()(size_t a, size_t b) const {
+      return items[a*m+dim] < items[b*m+dim];
+   }
+};
+
+
+bool HClustKdTreeSingle::isSupported(Distance* dist)
+{
+   return dynamic_cast<EuclideanDistance*>(dist) != NULL ||
+      dynamic_cast<SquaredEuclideanDistance*>(dist) != NULL;
+}
+
+
+// constructor (OK, we all know what this is, but I label it for faster in-code search)
+HClustKdTreeSingle::HClustKdTreeSingle(Distance* dist, HClustOptions* opts) :
+      HClustNNbasedSingle(dist, opts),
+      root(NULL),
+      depth(0),
+      m(0),
+      items(NULL),
+      squared(dynamic_cast<SquaredEuclideanDistance*>(dist) != NULL)
+{
+   STOPIFNOT(isSupported(dist));
+   GenericMatrixDistance* mdist = dynamic_cast<GenericMatrixDistance*>(dist);
+   m = mdist->getDim();
+   items = mdist->getItems();
+
+   MESSAGE_2("[%010.3f] building kd-tree\n", clock()/(float)CLOCKS_PER_SEC);
+   root = buildFromPoints(0, n);
+}
+
+
+HClustKdTreeSingle::~HClustKdTreeSingle() {
+   if(root) delete root;
+}
+
+
+HClustKdTreeSingleNode* HClustKdTreeSingle::buildFromPoints(size_t left,
+   size_t right, size_t level)
+{
+#ifdef GENERATE_STATS
+   ++stats.nodeCount;
+#endif
+   if (level > depth) depth = level;
+   HClustKdTreeSingleNode* node = new HClustKdTreeSingleNode(left, right, m);
+
+   // bounding box
+   for (size_t u=0; u<m; ++u)
+      node->lo[u] = node->hi[u] = items[indices[left]*m+u];
+   for (size_t i=left+1; i<right; ++i) {
+      const double* x = items+indices[i]*m;
+      for (size_t u=0; u<m; ++u) {
+         if (x[u] < node->lo[u]) node->lo[u] = x[u];
+         else if (x[u] > node->hi[u]) node->hi[u] = x[u];
+      }
+   }
+
+   // split along the widest side
+   size_t dim = 0;
+   for (size_t u=1; u<m; ++u)
+      if (node->hi[u]-node->lo[u] > node->hi[dim]-node->lo[dim])
+         dim = u;
+
+   if (right - left <= opts->maxLeavesElems || !(node->hi[dim] > node->lo[dim]))
+   {
+      // a leaf (also if all the points are identical)
+   #ifdef GENERATE_STATS
+      ++stats.leafCount;
+   #endif
+      return node;
+   }
+
+   size_t median = (right + left) / 2;
+   std::nth_element(indices.begin()+left, indices.begin()+median,
+      indices.begin()+right, KdTreeCoordComparator(items, m, dim));
+
+   node->childL = buildFromPoints(left, median, level+1);
+   node->childR = buildFromPoints(median, right, level+1);
+
+   return node;
+}
+
+
+double HClustKdTreeSingle::getLowerBound(const double* x, HClustKdTreeSingleNode* node)
+{
+   // the coordinates are summed up in the same order as in
+   // (Squared)EuclideanDistance::compute(), hence - due to monotonicity
+   // of floating point operations - the bound is never greater
+   // than the actual computed distance
+   double d = 0.0;
+   for (size_t u=0; u<m; ++u) {
+      if (x[u] < node->lo[u])
+         d += (node->lo[u]-x[u])*(node->lo[u]-x[u]);
+      else if (x[u] > node->hi[u])
+         d += (x[u]-node->hi[u])*(x[u]-node->hi[u]);
+   }
+   return (squared)?d:sqrt(d);
+}
+
+
+double HClustKdTreeSingle::getUpperBound(const double* x, HClustKdTreeSingleNode* node)
+{
+   double d = 0.0;
+   for (size_t u=0; u<m; ++u) {
+      double d2 = std::max(x[u]-node->lo[u], node->hi[u]-x[u]);
+      d += d2*d2;
+   }
+   return (squared)?d:sqrt(d);
+}
+
+
+void HClustKdTreeSingle::getNearestNeighborsFromMinRadiusLeaf(
+   HClustKdTreeSingleNode* node, size_t index, size_t lowest,
+   size_t clusterIndex, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap)
+{
+   STOPIFNOT(node->childL == NULL);
+   if (!prefetch && !node->sameCluster) {
+      size_t commonCluster = findCluster(node->left);
+      for (size_t i=node->left; i<node->right; ++i) {
+         size_t currentCluster = findCluster(i);
+         if (currentCluster != commonCluster) commonCluster = SIZE_MAX;
+         if (currentCluster == clusterIndex) continue;
+         if (i < lowest) continue;
+         double dist2 = (*distance)(indices[index], indices[i]); // the slow part
+         if (dist2 > maxR || dist2 <= minR) continue;
+         if (dist2 < bestR.top()) bestR.replaceTop(dist2);
+
+         nnheap.insert(i, dist2, maxR);
+      }
+      if (commonCluster != SIZE_MAX)
+         node->sameCluster = true; // set to true (btw, may be true already)
+   }
+   else /* node->sameCluster */ {
+      for (size_t i=node->left; i<node->right; ++i) {
+         if (i < lowest) continue;
+         double dist2 = (*distance)(indices[index], indices[i]); // the slow part
+         if (dist2 > maxR || dist2 <= minR) continue;
+         if (dist2 < bestR.top()) bestR.replaceTop(dist2);
+
+         nnheap.insert(i, dist2, maxR);
+      }
+   }
+}
+
+
+void HClustKdTreeSingle::getNearestNeighborsFromMinRadius(
+   size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx)
+{
+   // search within (minR, maxR]
+   // depth-first, the nearer child first; a subtree is skipped if
+   // the bounding box is entirely outside of the search window
+   std::vector<HClustKdTreeSingleStackItem>& stack =
+      static_cast<HClustKdTreeSingleContext&>(ctx).stack;
+   NNBestRadii& bestR = ctx.bestR;
+   NNHeap& nnheap = ctx.nnheap;
+   bestR.reset(ctx.minNN);
+   size_t lowest = ctx.lowest;
+   double maxR = INFINITY;
+   size_t nodesVisited = 0;
+   const double* x = items+indices[index]*m;
+
+   stack.clear(); // capacity is retained
+   if (lowest <= root->maxindex)
+      stack.push_back(HClustKdTreeSingleStackItem(root, 0.0));
+   while (!stack.empty()) {
+      HClustKdTreeSingleStackItem cur = stack.back();
+      stack.pop_back();
+      HClustKdTreeSingleNode* node = cur.node;
+
+      if (cur.lb > maxR)
+         continue;
+
+      if (bestR.top() < cur.lb) {
+         // enough neighbors closer than anything in this subtree;
+         // drop the ones that could be beaten by its elements
+         while (!nnheap.empty() && nnheap.top().dist >= cur.lb)
+            nnheap.pop();
+         maxR = std::nextafter(cur.lb, -INFINITY);
+         continue;
+      }
+
+      if (++nodesVisited > ctx.nodesVisitedLimit) {
+         ctx.cutShort = true;
+         break;
+      }
+
+      #ifdef GENERATE_STATS
+      #ifdef _OPENMP
+      #pragma omp atomic
+      #endif
+         ++stats.nodeVisit;
+      #endif
+
+      if (!prefetch) {
+         updateSameClusterFlag(node);
+         if (node->sameCluster && clusterIndex == findCluster(node->left))
+            continue;
+      }
+
+      if (!node->childL) { // leaf
+         getNearestNeighborsFromMinRadiusLeaf(node, index, lowest, clusterIndex,
+            minR, bestR, maxR, nnheap);
+         continue;
+      }
+
+      bool goL = (lowest <= node->childL->maxindex && getUpperBound(x, node->childL) > minR);
+      bool goR = (lowest <= node->childR->maxindex && getUpperBound(x, node->childR) > minR);
+      double lbL = (goL)?getLowerBound(x, node->childL):INFINITY;
+      double lbR = (goR)?getLowerBound(x, node->childR):INFINITY;
+      goL = goL && lbL <= maxR;
+      goR = goR && lbR <= maxR;
+
+      // the far one goes first, so that the near one is popped first
+      if (lbL <= lbR) {
+         if (goR) stack.push_back(HClustKdTreeSingleStackItem(node->childR, lbR));
+         if (goL) stack.push_back(HClustKdTreeSingleStackItem(node->childL, lbL));
+      }
+      else {
+         if (goL) stack.push_back(HClustKdTreeSingleStackItem(node->childL, lbL));
+         if (goR) stack.push_back(HClustKdTreeSingleStackItem(node->childR, lbR));
+      }
+   }
+}
+
+
+void HClustKdTreeSingle::updateSameClusterFlag(HClustKdTreeSingleNode* node)
+{
+   if (prefetch || node->sameCluster || !node->childL ||
+      !node->childL->sameCluster || !node->childR->sameCluster
+   ) return;
+
+   // otherwise check if node->sameCluster flag needs updating
+   if (findCluster(node->childL->left) != findCluster(node->childR->left))
+      return; // not ready yet
+   node->sameCluster = true;
+}
@@ -0,0 +1,116 @@
+/* ************************************************************************* *
+ *   This file is part of the `genie` package for R.                         *
+ *                                                                           *
+ *   Copyright 2015-2018 Marek Gagolewski, Maciej Bartoszuk, Anna Cena       *
+ *                                                                           *
+ *   'genie' is free software: you can redistribute it and/or                *
+ *   modify it under the terms of the GNU General Public License             *
+ *   as published by the Free Software Foundation, either version 3          *
+ *   of the License, or (at your option) any later version.                  *
+ *                                                                           *
+ *   'genie' is distributed in the hope that it will be useful,              *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with 'genie'. If not, see <http://www.gnu.org/licenses/>.         *
+ * ************************************************************************* */
+
+#ifndef __HCLUST2_KDTREE_SINGLE_H
+#define __HCLUST2_KDTREE_SINGLE_H
+
+
+
+// ************************************************************************
+
+#include "hclust2_nnbased_single.h"
+
+
+namespace grup
+{
+
+struct HClustKdTreeSingleNode
+{
+   size_t left;   // elements are indices[left..right-1]
+   size_t right;
+   double* lo;    // bounding box, m coordinates each
+   double* hi;
+   bool sameCluster;
+   size_t maxindex;
+   HClustKdTreeSingleNode* childL;
+   HClustKdTreeSingleNode* childR;
+
+   HClustKdTreeSingleNode(size_t left, size_t right, size_t m) :
+         left(left), right(right), lo(new double[m]), hi(new double[m]),
+         sameCluster(false), maxindex(right-1), childL(NULL), childR(NULL)  { }
+
+   ~HClustKdTreeSingleNode() {
+      delete [] lo;
+      delete [] hi;
+      if (childL) delete childL;
+      if (childR) delete childR;
+   }
+};
+
+
+struct HClustKdTreeSingleStackItem
+{
+   HClustKdTreeSingleNode* node;
+   double lb; // lower bound for the distance between the query and node's elements
+
+   HClustKdTreeSingleStackItem(HClustKdTreeSingleNode* node, double lb) :
+         node(node), lb(lb) { }
+};
+
+
+struct HClustKdTreeSingleContext : public NNSearchContext
+{
+   std::vector<HClustKdTreeSingleStackItem> stack; // explicit traversal stack
+
+   HClustKdTreeSingleContext(HClustOptions* opts, size_t depth) :
+         NNSearchContext(opts),
+         stack() {
+      stack.reserve(depth+2);
+   }
+};
+
+
+class HClustKdTreeSingle : public HClustNNbasedSingle
+{
+protected:
+   HClustKdTreeSingleNode* root;
+   size_t depth;
+   size_t m;
+   const double* items; // row-major, n*m
+   bool squared;        // squared Euclidean distance?
+
+   HClustKdTreeSingleNode* buildFromPoints(size_t left, size_t right, size_t level=0);
+
+   double getLowerBound(const double* x, HClustKdTreeSingleNode* node);
+   double getUpperBound(const double* x, HClustKdTreeSingleNode* node);
+
+   void getNearestNeighborsFromMinRadiusLeaf(HClustKdTreeSingleNode* node,
+      size_t index, size_t lowest, size_t clusterIndex, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap);
+
+   virtual NNSearchContext* createSearchContext() {
+      return new HClustKdTreeSingleContext(opts, depth);
+   }
+
+   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx);
+
+   void updateSameClusterFlag(HClustKdTreeSingleNode* node);
+
+public:
+
+   HClustKdTreeSingle(Distance* dist, HClustOptions* opts);
+   ~HClustKdTreeSingle();
+
+   static bool isSupported(Distance* dist);
+
+}; // class
+
+} // namespace grup
+
+
+#endif
@@ -20,10 +20,25 @@
 
 #include "hclust2_mstbased_gini.h"
 #include "hclust2_vptree_single.h"
+#include "hclust2_kdtree_single.h"
+#include "hclust2_gnat_single.h"
+#include "hclust2_covertree_single.h"
 
 using namespace grup;
 
 
+// is d(q,x) >= |d(q,p)-d(x,p)| > maxR for some pivot p?
+static inline bool isLowerBoundAbove(const double* qpivots, const double* xpivots,
+   size_t npivots, double maxR)
+{
+   for (size_t t=0; t<npivots; ++t) {
+      if (std::fabs(qpivots[t]-xpivots[t]) > maxR)
+         return true;
+   }
+   return false;
+}
+
+
 // constructor (OK, we all know what this is, but I label it for faster in-code search)
 HClustMSTbasedGini::HClustMSTbasedGini(Distance* dist, HClustOptions* opts) :
       opts(opts),
@@ -43,105 +58,264 @@ HClustMSTbasedGini::~HClustMSTbasedGini()
 }
 
 
+void HClustMSTbasedGini::saveMST(HClustCheckpoint& checkpoint, size_t lastj,
+   const std::vector<size_t>& todo, const std::vector<double>& Tdist,
+   const std::vector<size_t>& Tfrom, const std::vector<HeapHierarchicalItem>& edges)
+{
+   // ints: {lastj}, todo, Afrom, edges' endpoints; reals: Adist, edges' lengths
+   // (Adist and Afrom are indexed by the points' ids)
+   HClustCheckpointData& data = checkpoint.prepare(HCLUST2_CHECKPOINT_PRIM);
+   data.ints.resize(4);
+   data.reals.resize(2);
+   data.ints[0].push_back((uint64_t)lastj);
+   data.ints[1].assign(todo.begin(), todo.end());
+   data.ints[2].assign(n, (uint64_t)SIZE_MAX);
+   data.reals[0].assign(n, INFINITY);
+   for (size_t k=0; k<todo.size(); ++k) {
+      data.ints[2][todo[k]] = (uint64_t)Tfrom[k];
+      data.reals[0][todo[k]] = Tdist[k];
+   }
+   data.ints[3].reserve(2*edges.size());
+   data.reals[1].reserve(edges.size());
+   for (size_t k=0; k<edges.size(); ++k) {
+      data.ints[3].push_back((uint64_t)edges[k].index1);
+      data.ints[3].push_back((uint64_t)edges[k].index2);
+      data.reals[1].push_back(edges[k].dist);
+   }
+   checkpoint.save();
+}
+
+
+bool HClustMSTbasedGini::loadMST(HClustCheckpoint& checkpoint, size_t& lastj,
+   std::vector<size_t>& todo, std::vector<double>& Tdist,
+   std::vector<size_t>& Tfrom, std::vector<HeapHierarchicalItem>& edges)
+{
+   HClustCheckpointData data;
+   if (!checkpoint.load(HCLUST2_CHECKPOINT_PRIM, data))
+      return false;
+
+   bool ok = data.ints.size() == 4 && data.reals.size() == 2 &&
+      data.ints[0].size() == 1 && data.ints[0][0] < n &&
+      data.ints[2].size() == n && data.reals[0].size() == n &&
+      data.ints[3].size() == 2*data.reals[1].size() &&
+      data.ints[1].size() + data.reals[1].size() == n-1;
+   for (size_t k=0; ok && k<data.ints[1].size(); ++k)
+      ok = data.ints[1][k] < n;
+   for (size_t k=0; ok && k<data.ints[3].size(); ++k)
+      ok = data.ints[3][k] < n;
+   if (!ok) {
+      Rf_warning("the checkpoint is damaged. starting afresh");
+      return false;
+   }
+
+   lastj = (size_t)data.ints[0][0];
+   todo.assign(data.ints[1].begin(), data.ints[1].end());
+   Tdist.resize(todo.size());
+   Tfrom.resize(todo.size());
+   for (size_t k=0; k<todo.size(); ++k) {
+      Tdist[k] = data.reals[0][todo[k]];
+      Tfrom[k] = (data.ints[2][todo[k]] < n)?(size_t)data.ints[2][todo[k]]:SIZE_MAX;
+   }
+   edges.clear();
+   for (size_t k=0; k<data.reals[1].size(); ++k)
+      edges.push_back(HeapHierarchicalItem((size_t)data.ints[3][2*k],
+         (size_t)data.ints[3][2*k+1], data.reals[1][k]));
+   return true;
+}
+
+
 HclustPriorityQueue HClustMSTbasedGini::getMST()
 {
    MESSAGE_2("[%010.3f] determing the MST\n", clock()/(float)CLOCKS_PER_SEC);
 
    HclustPriorityQueue out(n);
 
-   vector<size_t> todo(n-1); // elements which are still not in the spanning tree
+   // the elements which are still not in the spanning tree, together with
+   // their distances to it and their nearest tree elements (all three
+   // are indexed by the same position, i.e., scanned sequentially);
+   // the one that joins the tree is replaced by the last one
+   vector<size_t> todo(n-1);
    for (size_t k=0; k<n-1; ++k) todo[k] = k+1;
-   std::vector<double> Adist(n, INFINITY);
-   std::vector<size_t> Afrom(n, SIZE_MAX);
+   std::vector<double> Tdist(n-1, INFINITY);
+   std::vector<size_t> Tfrom(n-1, SIZE_MAX);
 
    size_t lastj = 0; // a randomly chosen element :)
-   for (size_t i=0; i<n-1; ++i) { // there are n-1 edges in a spanning tree
-      size_t bestj = 0;   // always Adist[0] == INFINITY
-      size_t bestjpos = 0;
 
-      STOPIFNOT(todo.size() == n-i-1)
-      #ifdef _OPENMP
-      #pragma omp parallel for schedule(static)
-      #endif
-      for (size_t k=0; k<n-i-1; ++k) {
-         // the thread-safe part:
-         size_t j = todo[k];
-         double curdist = (*distance)(lastj,j); // this takes some time...
-         if (curdist < Adist[j]) {
-            Adist[j] = curdist;
-            Afrom[j] = lastj;
-         }
-
-         // the thread-unsafe part:
-         #ifndef _OPENMP
-         if (Adist[bestj] > Adist[j]) {
-            bestj = j;
-            bestjpos = k;
-         }
+   HClustCheckpoint checkpoint(opts, distance);
+   std::vector<HeapHierarchicalItem> edges; // the MST edges so far, for the checkpoints only
+   loadMST(checkpoint, lastj, todo, Tdist, Tfrom, edges);
+   for (size_t k=0; k<edges.size(); ++k)
+      out.push(edges[k]);
+   if (!checkpoint.isEnabled()) edges.clear();
+
+   // Tpivots[k*npivots+t] is the distance between todo[k] and the t-th pivot,
+   // lastPivots - between lastj and the pivots; the pivots are chosen
+   // by the farthest-first traversal
+   size_t npivots = std::min(opts->primPivots, n);
+   if (npivots > 0 && dynamic_cast<SquaredEuclideanDistance*>(distance) != NULL) {
+      // the lower bounds rely on the triangle inequality
+      Rf_warning("primPivots requires a metric distance. ignoring");
+      npivots = 0;
+   }
+   std::vector<double> Tpivots;
+   std::vector<double> lastPivots(npivots);
+   if (npivots > 0 && !todo.empty()) {
+      std::vector<double> pivots(n*npivots);
+      std::vector<double> minPivotDist(n, INFINITY);
+      size_t p = 0;
+      for (size_t t=0; t<npivots; ++t) {
+         #ifdef _OPENMP
+         #pragma omp parallel for schedule(static)
          #endif
+         for (size_t j=0; j<n; ++j) {
+            pivots[j*npivots+t] = (*distance)(p, j);
+            minPivotDist[j] = std::min(minPivotDist[j], pivots[j*npivots+t]);
+         }
+         p = (size_t)(std::max_element(minPivotDist.begin(), minPivotDist.end())-minPivotDist.begin());
       }
 
+      Tpivots.resize(todo.size()*npivots);
+      for (size_t k=0; k<todo.size(); ++k)
+         std::copy(&pivots[todo[k]*npivots], &pivots[todo[k]*npivots]+npivots, &Tpivots[k*npivots]);
+      std::copy(&pivots[lastj*npivots], &pivots[lastj*npivots]+npivots, lastPivots.begin());
+   }
+
+   // each thread's best candidate (position in todo) for the current iteration
+   std::vector<size_t> threadBest(MAX_THREADS_NUM, SIZE_MAX);
+
+   for (size_t i=n-1-todo.size(); i<n-1; ++i) { // there are n-1 edges in a spanning tree
+      size_t m = todo.size();
+      STOPIFNOT(m == n-i-1)
+
+      // update the distances to the tree and find the closest element
+      // in a single pass over each thread's chunk; the ties are resolved
+      // in favour of the smallest id, whatever the order in todo
       #ifdef _OPENMP
-      // to avoid establishing a (slow!) critical section in
-      // the above loop, this fast part is done single-threadedly
-      for (size_t k=0; k<n-i-1; ++k) {
-         if (Adist[bestj] > Adist[todo[k]]) {
-            bestj = todo[k];
-            bestjpos = k;
+      #pragma omp parallel
+      #endif
+      {
+         size_t best = SIZE_MAX;
+         size_t skipped = 0;
+         #ifdef _OPENMP
+         #pragma omp for schedule(static) nowait
+         #endif
+         for (size_t k=0; k<m; ++k) {
+            if (npivots > 0 && isLowerBoundAbove(lastPivots.data(),
+                  &Tpivots[k*npivots], npivots, Tdist[k]))
+               ++skipped; // d(lastj, todo[k]) > Tdist[k]
+            else {
+               double curdist = (*distance)(lastj, todo[k]); // this takes some time...
+               if (curdist < Tdist[k]) {
+                  Tdist[k] = curdist;
+                  Tfrom[k] = lastj;
+               }
+            }
+            if (best == SIZE_MAX || Tdist[k] < Tdist[best] ||
+                  (Tdist[k] == Tdist[best] && todo[k] < todo[best]))
+               best = k;
          }
+         threadBest[CURRENT_THREAD_NUM] = best;
+         #ifdef _OPENMP
+         #pragma omp atomic
+         #endif
+         stats.primSkipped += skipped;
       }
-      #endif
 
-      out.push(HeapHierarchicalItem(Afrom[bestj], bestj, Adist[bestj]));
-      todo.erase(todo.begin()+bestjpos); // the algorithm is O(n^2) anyway + we need to iterate thru todo sequentially
+      size_t bestpos = SIZE_MAX;
+      for (size_t t=0; t<threadBest.size(); ++t) {
+         size_t k = threadBest[t];
+         if (k == SIZE_MAX) continue;
+         if (bestpos == SIZE_MAX || Tdist[k] < Tdist[bestpos] ||
+               (Tdist[k] == Tdist[bestpos] && todo[k] < todo[bestpos]))
+            bestpos = k;
+         threadBest[t] = SIZE_MAX;
+      }
+      STOPIFNOT(bestpos != SIZE_MAX)
+      size_t bestj = todo[bestpos];
+
+      out.push(HeapHierarchicalItem(Tfrom[bestpos], bestj, Tdist[bestpos]));
+      if (checkpoint.isEnabled())
+         edges.push_back(HeapHierarchicalItem(Tfrom[bestpos], bestj, Tdist[bestpos]));
+
+      todo[bestpos]  = todo[m-1];  todo.pop_back();
+      Tdist[bestpos] = Tdist[m-1]; Tdist.pop_back();
+      Tfrom[bestpos] = Tfrom[m-1]; Tfrom.pop_back();
+      if (npivots > 0) {
+         std::copy(&Tpivots[bestpos*npivots], &Tpivots[bestpos*npivots]+npivots, lastPivots.begin());
+         std::copy(&Tpivots[(m-1)*npivots], &Tpivots[(m-1)*npivots]+npivots, &Tpivots[bestpos*npivots]);
+         Tpivots.resize((m-1)*npivots);
+      }
       lastj = bestj;
 
+      if (checkpoint.isDue())
+         saveMST(checkpoint, lastj, todo, Tdist, Tfrom, edges);
+
       if (i % 512 == 0) MESSAGE_7("\r                    get MST: %d / %d", i, n-1);
       Rcpp::checkUserInterrupt(); // may throw an exception, fast op, not thread safe
    }
    MESSAGE_7("\r                    get MST: %d / %d                   \n", n-1, n-1);
 
+   if (checkpoint.isEnabled()) {
+      // a resumed run will go straight to the merge phase
+      saveMST(checkpoint, lastj, todo, Tdist, Tfrom, edges);
+      checkpoint.finish();
+   }
+
    return out;
 }
 
 
-void HClustMSTbasedGini::linkAndRecomputeGini(PhatDisjointSets& ds, double& lastGini, size_t s1, size_t s2)
+void HClustMSTbasedGini::linkAndRecomputeGini(PhatDisjointSets& ds, HClustGiniIndex& gini,
+   double& lastGini, size_t s1, size_t s2)
 {
    // if opts.thresholdGini == 1.0, there's no need to compute the Gini index
    if (opts->thresholdGini < 1.0) {
-      double size1 = ds.getClusterSize(s1);
-      double size2 = ds.getClusterSize(s2);
-      lastGini *= (n)*(double)(ds.getClusterCount()-1);
-      std::size_t curi = s1;
-      do {
-         double curs = ds.getClusterSize(curi);
-         lastGini -= std::fabs(curs-size1);
-         lastGini -= std::fabs(curs-size2);
-         lastGini += std::fabs(curs-size1-size2);
-         curi = ds.getClusterNext(curi);
-      } while (curi != s1);
-      lastGini += std::fabs(size2-size1);
-      lastGini -= std::fabs(size2-size1-size2);
-      lastGini -= std::fabs(size1-size1-size2);
+      gini.link(ds.getClusterSize(s1), ds.getClusterSize(s2));
+      lastGini = gini.get();
    }
 
-   s1 = ds.link(s1, s2);
+   ds.link(s1, s2);
+}
 
-   if (opts->thresholdGini < 1.0) {
-      lastGini /= (n)*(double)(ds.getClusterCount()-1);
-      lastGini = std::min(1.0, std::max(0.0, lastGini)); // avoid numeric inaccuracies
-   }
+
+
+HClustResult HClustMSTbasedGini::computeNNbased(HClustNNbasedSingle& hclust)
+{
+   HClustResult res = hclust.compute(/*merge,order not needed*/opts->thresholdGini < 1.0);
+   stats = hclust.getStats();
+   return res;
 }
 
 
+HClustResult HClustMSTbasedGini::computeNNbased()
+{
+   if (opts->index == HCLUST2_INDEX_KDTREE) {
+      if (HClustKdTreeSingle::isSupported(distance)) {
+         HClustKdTreeSingle hclust(distance, opts);
+         return computeNNbased(hclust);
+      }
+      Rf_warning("kd-tree supports only (squared) Euclidean distances. using vp-tree");
+   }
+   else if (opts->index == HCLUST2_INDEX_GNAT) {
+      HClustGnatSingle hclust(distance, opts);
+      return computeNNbased(hclust);
+   }
+   else if (opts->index == HCLUST2_INDEX_COVERTREE) {
+      HClustCoverTreeSingle hclust(distance, opts);
+      return computeNNbased(hclust);
+   }
+
+   HClustVpTreeSingle hclust(distance, opts);
+   return computeNNbased(hclust);
+}
+
 
 HClustResult HClustMSTbasedGini::compute()
 {
    HclustPriorityQueue pq;
 
    if (opts->useVpTree) {
-      HClustVpTreeSingle hclust(distance, opts);
-      HClustResult res = hclust.compute(/*merge,order not needed*/opts->thresholdGini < 1.0);
+      HClustResult res = computeNNbased();
       if (opts->thresholdGini >= 1.0) return res;
 
       Rcpp::NumericMatrix links = res.getLinks();
@@ -159,6 +333,7 @@ HClustResult HClustMSTbasedGini::compute()
 
    HClustResult res(n, distance);
    PhatDisjointSets ds(n);
+   HClustGiniIndex gini((opts->thresholdGini < 1.0)?n:0);
 
    MESSAGE_2("[%010.3f] merging clusters\n", clock()/(float)CLOCKS_PER_SEC);
 
@@ -185,7 +360,7 @@ HClustResult HClustMSTbasedGini::compute()
       std::size_t lastminsize = minsize;
       res.link(hhi.index1, hhi.index2,
          (lastGini <= opts->thresholdGini)?hhi.dist:-hhi.dist);
-      linkAndRecomputeGini(ds, lastGini, s1, s2);
+      linkAndRecomputeGini(ds, gini, lastGini, s1, s2);
 
       if (opts->thresholdGini < 1.0)
          minsize = ds.getMinClusterSize();
@@ -32,10 +32,71 @@
 #include "hclust2_common.h"
 #include "disjoint_sets.h"
 #include "hclust2_result.h"
+#include "hclust2_checkpoint.h"
 
 namespace grup
 {
 
+class HClustNNbasedSingle;
+
+
+class HClustGiniIndex
+{
+   // the Gini index of the cluster sizes, i.e., sum_{i<j} |c_i-c_j|
+   // divided by n(k-1), where k is the number of clusters; it depends
+   // only on the multiset of the sizes, which is stored in two Fenwick
+   // trees (the number of clusters of each size and their total size),
+   // hence a merge takes O(log n) time
+protected:
+   size_t n;
+   size_t k;
+   std::vector<double> countTree; // 1-based, over the sizes 1..n
+   std::vector<double> sizeTree;
+   double total;     // the sum of all the sizes stored
+   double numerator; // sum_{i<j} |c_i-c_j|, an integer
+
+   inline void add(size_t size, double count) {
+      for (size_t x=size; x<=n; x += x & (~x+1)) {
+         countTree[x] += count;
+         sizeTree[x]  += count*(double)size;
+      }
+      total += count*(double)size;
+   }
+
+   // sum_i |c_i-size|
+   inline double sumAbsDiff(size_t size) const {
+      double countLE = 0.0, sizeLE = 0.0;
+      for (size_t x=size; x>0; x -= x & (~x+1)) {
+         countLE += countTree[x];
+         sizeLE  += sizeTree[x];
+      }
+      double countAll = (double)k;
+      return (double)size*countLE - sizeLE + (total-sizeLE) - (double)size*(countAll-countLE);
+   }
+
+public:
+   // n singletons
+   HClustGiniIndex(size_t n) :
+         n(n), k(n), countTree(n+1, 0.0), sizeTree(n+1, 0.0),
+         total(0.0), numerator(0.0) {
+      if (n > 0) add(1, (double)n);
+   }
+
+   // merges two clusters of given sizes
+   inline void link(size_t size1, size_t size2) {
+      add(size1, -1.0); --k;
+      numerator -= sumAbsDiff(size1);
+      add(size2, -1.0); --k;
+      numerator -= sumAbsDiff(size2);
+      numerator += sumAbsDiff(size1+size2);
+      add(size1+size2, 1.0); ++k;
+   }
+
+   inline double get() const {
+      if (k <= 1) return 0.0;
+      return std::min(1.0, numerator/((double)n*(double)(k-1)));
+   }
+};
 
 
 class HClustMSTbasedGini
@@ -48,7 +109,16 @@ protected:
    Distance* distance;
 
    HclustPriorityQueue getMST();
-   void linkAndRecomputeGini(PhatDisjointSets& ds, double& lastGini, size_t s1, size_t s2);
+   void saveMST(HClustCheckpoint& checkpoint, size_t lastj,
+      const std::vector<size_t>& todo, const std::vector<double>& Tdist,
+      const std::vector<size_t>& Tfrom, const std::vector<HeapHierarchicalItem>& edges);
+   bool loadMST(HClustCheckpoint& checkpoint, size_t& lastj,
+      std::vector<size_t>& todo, std::vector<double>& Tdist,
+      std::vector<size_t>& Tfrom, std::vector<HeapHierarchicalItem>& edges);
+   HClustResult computeNNbased();
+   HClustResult computeNNbased(HClustNNbasedSingle& hclust);
+   void linkAndRecomputeGini(PhatDisjointSets& ds, HClustGiniIndex& gini,
+      double& lastGini, size_t s1, size_t s2);
 
 public:
 
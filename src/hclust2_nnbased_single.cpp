@@ -19,24 +19,56 @@
 
 
 #include "hclust2_nnbased_single.h"
+#include <atomic>
+#include <thread>
 
 using namespace grup;
 
 
+// Rcpp::checkUserInterrupt() that does not throw
+static void checkInterruptFn(void* /*dummy*/) { R_CheckUserInterrupt(); }
+static inline bool isUserInterrupt() { return R_ToplevelExec(checkInterruptFn, NULL) == FALSE; }
+
+
 // constructor (OK, we all know what this is, but I label it for faster in-code search)
 HClustNNbasedSingle::HClustNNbasedSingle(Distance* dist, HClustOptions* opts) :
       opts(opts),
       n(dist->getObjectCount()),
       distance(dist),
       indices(dist->getObjectCount()),
-      neighborsCount(dist->getObjectCount(), 0),
-      minRadiuses(dist->getObjectCount(), -INFINITY),
-      shouldFind(dist->getObjectCount(), true),
+      points(dist->getObjectCount()),
    #ifdef GENERATE_STATS
       stats(),
    #endif
-      ds(dist->getObjectCount())
+      ds(dist->getObjectCount()),
+      prefetch(false),
+      bufferPushes(false),
+      maxNN(opts->maxNNPrefetch),
+      maxNNPrefetch(opts->maxNNPrefetch),
+      minNNPrefetch(opts->minNNPrefetch),
+      minNNMerge(opts->minNNMerge),
+      mergeEpoch(0),
+      clusterCache(dist->getObjectCount()),
+      checkpoint(opts, dist)
 {
+   if (n >= HeapCompactItem::MAX_OBJECTS)
+      Rcpp::stop("too many objects");
+
+   // the candidate edges take the most memory: up to maxNNPrefetch per point;
+   // the caps are kept in the members above, opts is not modified
+   double maxNNLimit = opts->memoryLimitMB*1048576.0/sizeof(HeapCompactItem)/(double)n;
+   if (maxNNLimit < (double)maxNNPrefetch) {
+      if (maxNNLimit < 1.0) {
+         maxNNLimit = 1.0;
+         Rf_warning("memoryLimitMB is too small. using maxNNPrefetch=1");
+      }
+      maxNNPrefetch = (size_t)maxNNLimit;
+      minNNPrefetch = std::min(minNNPrefetch, maxNNPrefetch);
+      minNNMerge    = std::min(minNNMerge, maxNNPrefetch);
+      maxNN = maxNNPrefetch;
+   }
+   stats.maxNNPrefetch = maxNNPrefetch;
+
    // starting indices: random permutation of {0,1,...,_n-1}
    for (size_t i=0;i<n;i++)
       indices[i] = i;
@@ -53,28 +85,104 @@ HClustNNbasedSingle::~HClustNNbasedSingle() {
 #ifdef _OPENMP
    omp_destroy_lock(&pqwritelock);
 #endif
+   for (size_t t=0; t<contexts.size(); ++t)
+      if (contexts[t]) delete contexts[t];
+}
+
+
+void HClustNNbasedSingle::initSearchContexts()
+{
+   // cannot be called from the constructor: createSearchContext() is virtual
+   if (!contexts.empty()) return;
+   contexts.resize(MAX_THREADS_NUM, NULL);
+   for (size_t t=0; t<contexts.size(); ++t)
+      contexts[t] = createSearchContext();
 }
 
 
 
 void HClustNNbasedSingle::getNearestNeighbors(
-   std::priority_queue< HeapHierarchicalItem > & pq,
+   HClustEdgeQueue& pq,
    size_t index)
 {
-   if (!shouldFind[index])
+   if (!points[index].shouldFind)
       return;
 
-   size_t clusterIndex = ds.find_set(index);
+   // the prefetch searches do not look at the clusters at all,
+   // so they may run while another thread is merging them
+   size_t clusterIndex = (prefetch)?SIZE_MAX:findCluster(index);
 #ifdef GENERATE_STATS
 #ifdef _OPENMP
 #pragma omp atomic
 #endif
    ++stats.nnCals;
 #endif
-   NNHeap nnheap;
-   getNearestNeighborsFromMinRadius(index, clusterIndex, minRadiuses[index], nnheap);
+   NNSearchContext& ctx = getSearchContext();
+   ctx.nnheap.clear();
+   ctx.nnheap.maxNN = maxNN;
+   ctx.nodesVisitedLimit = opts->nodesVisitedLimit;
+   ctx.cutShort = false;
+   ctx.lowest = index+1; // each edge is found from its smaller endpoint
+   ctx.minNN = (prefetch)?minNNPrefetch:minNNMerge;
+   getNearestNeighborsFromMinRadius(index, clusterIndex, points[index].minRadius, ctx);
+   if (ctx.cutShort) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+      ++stats.nnCutShort;
+
+      if (ctx.nnheap.empty()) {
+         // an approximate search gave nothing -- retry with no limit;
+         // this way each point (but the last one) has at least one candidate
+         // edge leading to a point with a greater index,
+         // hence the candidate edge graph is connected
+         ctx.nodesVisitedLimit = SIZE_MAX;
+         ctx.cutShort = false;
+         getNearestNeighborsFromMinRadius(index, clusterIndex, points[index].minRadius, ctx);
+      }
+   }
+   pushNearestNeighbors(pq, index, ctx.nnheap);
+}
+
+
+void HClustNNbasedSingle::pushNearestNeighbors(
+   HClustEdgeQueue& pq,
+   size_t index, NNHeap& nnheap)
+{
    size_t newNeighborsCount = 0.0;
 
+   if (bufferPushes) {
+      // each point is processed by one thread only: no need to lock anything;
+      // the items are gathered in per-thread buffers and moved to pq
+      // in flushBuffers()
+      HClustPointState& pt = points[index];
+      NNSearchContext& ctx = getSearchContext();
+      while (!nnheap.empty()) {
+         if (isfinite(nnheap.top().dist) && nnheap.top().index != SIZE_MAX) {
+            ++newNeighborsCount;
+            if (prefetch)
+               ctx.pqbuf.push_back(HeapCompactItem(index, nnheap.top().index, nnheap.top().dist));
+            else
+               ctx.pqbufExact.push_back(HeapHierarchicalItem(index, nnheap.top().index, nnheap.top().dist));
+            pt.minRadius = std::max(pt.minRadius, nnheap.top().dist);
+         }
+         nnheap.pop();
+      }
+      pt.neighborsCount += (uint32_t)newNeighborsCount;
+#ifdef GENERATE_STATS
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+      stats.nnCount += newNeighborsCount;
+#endif
+      if (pt.neighborsCount > n - index || newNeighborsCount == 0)
+         pt.shouldFind = false;
+      else
+         ctx.pqbufExact.push_back(HeapHierarchicalItem(index, SIZE_MAX, pt.minRadius)); // to be continued...
+      return;
+   }
+
+   HClustPointState& pt = points[index];
 #ifdef _OPENMP
    omp_set_lock(&pqwritelock);
 #endif
@@ -82,18 +190,18 @@ void HClustNNbasedSingle::getNearestNeighbors(
       if (isfinite(nnheap.top().dist) && nnheap.top().index != SIZE_MAX) {
          ++newNeighborsCount;
          pq.push(HeapHierarchicalItem(index, nnheap.top().index, nnheap.top().dist));
-         minRadiuses[index] = std::max(minRadiuses[index], nnheap.top().dist);
+         pt.minRadius = std::max(pt.minRadius, nnheap.top().dist);
       }
       nnheap.pop();
    }
-   neighborsCount[index] += newNeighborsCount;
+   pt.neighborsCount += (uint32_t)newNeighborsCount;
 #ifdef GENERATE_STATS
    stats.nnCount += newNeighborsCount;
 #endif
-   if (neighborsCount[index] > n - index || newNeighborsCount == 0)
-      shouldFind[index] = false;
+   if (pt.neighborsCount > n - index || newNeighborsCount == 0)
+      pt.shouldFind = false;
    else {
-      pq.push(HeapHierarchicalItem(index, SIZE_MAX, minRadiuses[index])); // to be continued...
+      pq.push(HeapHierarchicalItem(index, SIZE_MAX, pt.minRadius)); // to be continued...
    }
 #ifdef _OPENMP
    omp_unset_lock(&pqwritelock);
@@ -101,14 +209,14 @@ void HClustNNbasedSingle::getNearestNeighbors(
 }
 
 
-void HClustNNbasedSingle::computePrefetch(std::priority_queue< HeapHierarchicalItem > & pq)
+void HClustNNbasedSingle::computePrefetch(HClustEdgeQueue& pq)
 {
    // INIT: Pre-fetch a few nearest neighbors for each point
    MESSAGE_2("[%010.3f] prefetching NNs\n", clock()/(float)CLOCKS_PER_SEC);
 
 #ifdef _OPENMP
    omp_set_dynamic(0); /* the runtime will not dynamically adjust the number of threads */
-   #pragma omp parallel for schedule(dynamic)
+   #pragma omp parallel for schedule(dynamic, HCLUST2_NN_CHUNK_SIZE)
 #endif
    for (size_t i=0; i<n; i++)
    {
@@ -124,97 +232,541 @@ void HClustNNbasedSingle::computePrefetch(std::priority_queue< HeapHierarchicalI
 }
 
 
-void HClustNNbasedSingle::computeMerge(
-      std::priority_queue< HeapHierarchicalItem > & pq,
-      HClustResult& res)
+void HClustNNbasedSingle::flushBuffer(HClustEdgeQueue& pq,
+   std::vector<HeapCompactItem>& edges, std::vector<HeapHierarchicalItem>& items)
 {
-   MESSAGE_2("[%010.3f] merging clusters\n", clock()/(float)CLOCKS_PER_SEC);
+   for (size_t k=0; k<edges.size(); ++k) {
+      if (pq.acceptsCompact(edges[k]))
+         pq.push(edges[k]);
+      else {
+         // goes right to the exact heap (see refillEdgeQueue())
+         size_t i1 = edges[k].getIndex1();
+         size_t i2 = edges[k].getIndex2();
+         double dist = (edges[k].isExact())?(double)edges[k].key:
+            (*distance)(indices[i1], indices[i2]);
+         pq.pushExact(HeapHierarchicalItem(i1, i2, dist));
+      }
+   }
+   edges.clear();
+   for (size_t k=0; k<items.size(); ++k)
+      pq.push(items[k]);
+   items.clear();
+}
 
-   volatile bool go=true;
-   volatile size_t i = 0;
+
+void HClustNNbasedSingle::flushBuffers(HClustEdgeQueue& pq)
+{
+   if (!pq.empty()) {
+      for (size_t t=0; t<contexts.size(); ++t)
+         flushBuffer(pq, contexts[t]->pqbuf, contexts[t]->pqbufExact);
+      return;
+   }
+
+   // after prefetch: concatenate the per-thread buffers and heapify them
+   // in linear time instead of pushing the items one by one
+   size_t total = 0, totalExact = 0;
+   size_t largest = 0;
+   for (size_t t=0; t<contexts.size(); ++t) {
+      total += contexts[t]->pqbuf.size();
+      totalExact += contexts[t]->pqbufExact.size();
+      if (contexts[t]->pqbuf.size() > contexts[largest]->pqbuf.size())
+         largest = t;
+   }
+
+   std::vector<HeapCompactItem> items;
+   items.swap(contexts[largest]->pqbuf); // no copy for the largest one
+   items.reserve(total);
+   std::vector<HeapHierarchicalItem> itemsExact;
+   itemsExact.reserve(totalExact);
+   for (size_t t=0; t<contexts.size(); ++t) {
+      std::vector<HeapCompactItem>& pqbuf = contexts[t]->pqbuf;
+      items.insert(items.end(), pqbuf.begin(), pqbuf.end());
+      std::vector<HeapCompactItem>().swap(pqbuf); // release memory
+      std::vector<HeapHierarchicalItem>& pqbufExact = contexts[t]->pqbufExact;
+      itemsExact.insert(itemsExact.end(), pqbufExact.begin(), pqbufExact.end());
+      std::vector<HeapHierarchicalItem>().swap(pqbufExact);
+   }
+
+   pq.assign(items, itemsExact);
+}
+
+
+void HClustNNbasedSingle::refillEdgeQueue(HClustEdgeQueue& pq)
+{
+   // the edges with the smallest key get their exact distances
+   while (pq.needsRefill()) {
+      pq.popSmallestKey(refillBuf);
+      for (size_t k=0; k<refillBuf.size(); ++k) {
+         size_t i1 = refillBuf[k].getIndex1();
+         size_t i2 = refillBuf[k].getIndex2();
+         if (findCluster(i1) == findCluster(i2))
+            continue; // would be skipped anyway
+         double dist = (refillBuf[k].isExact())?(double)refillBuf[k].key:
+            (*distance)(indices[i1], indices[i2]); // recompute (index1 was the query)
+         pq.pushExact(HeapHierarchicalItem(i1, i2, dist));
+      }
+   }
+}
+
+
+void HClustNNbasedSingle::getNearestNeighbors(
+   HClustEdgeQueue& pq,
+   const std::vector<size_t>& batch)
+{
+   if (batch.size() == 1) {
+      getNearestNeighbors(pq, batch[0]);
+      return;
+   }
+
+   bufferPushes = true;
 #ifdef _OPENMP
-   #pragma omp parallel
+   #pragma omp parallel for schedule(dynamic)
 #endif
-   while (go)
-   {
+   for (size_t b=0; b<batch.size(); ++b)
+      getNearestNeighbors(pq, batch[b]);
+   bufferPushes = false;
+   flushBuffers(pq);
+}
+
+
+void HClustNNbasedSingle::saveLinks(size_t phase, const std::vector<HeapHierarchicalItem>& links)
+{
+   // ints: the links' endpoints (object ids); reals: their lengths
+   HClustCheckpointData& data = checkpoint.prepare(phase);
+   data.ints.resize(1);
+   data.reals.resize(1);
+   data.ints[0].reserve(2*links.size());
+   data.reals[0].reserve(links.size());
+   for (size_t k=0; k<links.size(); ++k) {
+      data.ints[0].push_back((uint64_t)indices[links[k].index1]);
+      data.ints[0].push_back((uint64_t)indices[links[k].index2]);
+      data.reals[0].push_back(links[k].dist);
+   }
+   checkpoint.save();
+}
+
+
+void HClustNNbasedSingle::loadLinks(size_t phase, std::vector<HeapHierarchicalItem>& links)
+{
+   HClustCheckpointData data;
+   if (!checkpoint.load(phase, data))
+      return;
+
+   bool ok = data.ints.size() == 1 && data.reals.size() == 1 &&
+      data.reals[0].size() <= n-1 && data.ints[0].size() == 2*data.reals[0].size();
+   for (size_t k=0; ok && k<data.ints[0].size(); ++k)
+      ok = data.ints[0][k] < n;
+   if (!ok) {
+      Rf_warning("the checkpoint is damaged. starting afresh");
+      return;
+   }
+
+   // the index may have permuted the objects in another way
+   std::vector<size_t> where(n);
+   for (size_t i=0; i<n; ++i)
+      where[indices[i]] = i;
+
+   // replaying the links restores the disjoint sets
+   for (size_t k=0; k<data.reals[0].size(); ++k) {
+      size_t i1 = where[(size_t)data.ints[0][2*k]];
+      size_t i2 = where[(size_t)data.ints[0][2*k+1]];
+      size_t s1 = ds.find_set(i1);
+      size_t s2 = ds.find_set(i2);
+      STOPIFNOT(s1 != s2);
+      ds.link(s1, s2);
+      links.push_back(HeapHierarchicalItem(std::min(i1, i2), std::max(i1, i2), data.reals[0][k]));
+   }
+   ++mergeEpoch; // invalidates clusterCache
+}
+
+
+void HClustNNbasedSingle::linkClusters(const HeapHierarchicalItem& hhi,
+   size_t s1, size_t s2, HClustResult& res, std::vector<HeapHierarchicalItem>& links)
+{
+   res.link(indices[hhi.index1], indices[hhi.index2], hhi.dist);
+   ds.link(s1, s2);
+   ++mergeEpoch; // invalidates clusterCache
+
+   if (checkpoint.isEnabled()) {
+      links.push_back(hhi);
+      if (checkpoint.isDue()) saveLinks(HCLUST2_CHECKPOINT_MERGE, links);
+   }
+}
+
+
+size_t HClustNNbasedSingle::computePipelinedMerge(
+      HClustEdgeQueue& pq,
+      HClustResult& res,
+      std::vector<HeapHierarchicalItem>& links,
+      size_t i)
+{
 #ifdef _OPENMP
-      omp_set_lock(&pqwritelock);
+   if (MAX_THREADS_NUM < 2) return i;
+
+   MESSAGE_2("[%010.3f] merging clusters (pipelined)\n", clock()/(float)CLOCKS_PER_SEC);
+
+   // the first pass has found a few NNs of each point, hence each point
+   // has a "to be continued" item in pq. Now the worker threads fetch
+   // more NNs, in the order of the points' radii, i.e., in the order
+   // this (the master) thread will most likely need them. Meanwhile,
+   // this thread merges the clusters: an edge at the top of pq is not
+   // longer than any edge yet to be found. Once a point's "to be
+   // continued" item is at the top, its new NNs must be in pq first:
+   // either a worker has already fetched them (they are published
+   // before the point is marked as done), or this thread must wait
+   // for the worker, or it fetches them itself.
+   std::vector<size_t> order;
+   for (size_t j=0; j<n; ++j)
+      if (points[j].shouldFind) order.push_back(j);
+   std::sort(order.begin(), order.end(), HClustPointRadiusComparator(&points));
+
+   enum { TODO = 0, FETCHING = 1, DONE = 2 };
+   std::vector< std::atomic<unsigned char> > state(n);
+   for (size_t j=0; j<n; ++j) state[j].store(TODO);
+   std::atomic<size_t> next(0);     // order[next] is the next one for the workers
+   std::atomic<size_t> finished(0); // number of workers that are done
+   std::atomic<bool> stop(false);
+   bool interrupted = false;        // checked by the master thread only
+
+   // the workers' results
+   std::vector<HeapCompactItem> published, taken;
+   std::vector<HeapHierarchicalItem> publishedExact, takenExact;
+   omp_lock_t publishlock;
+   omp_init_lock(&publishlock);
+
+   // all the searches are in the prefetch mode (no cluster lookups),
+   // as ds is being modified; compactIndex() must wait as well
+   bufferPushes = true;
+   omp_set_dynamic(0); /* the runtime will not dynamically adjust the number of threads */
+   #pragma omp parallel
+   {
+      NNSearchContext& ctx = getSearchContext();
+      if (omp_get_thread_num() != 0) {
+         while (!stop) {
+            size_t k = next++;
+            if (k >= order.size()) break;
+            size_t p = order[k];
+            unsigned char expected = TODO;
+            if (!state[p].compare_exchange_strong(expected, FETCHING))
+               continue; // taken by the master thread
+            getNearestNeighbors(pq, p); // buffered
+            omp_set_lock(&publishlock);
+            published.insert(published.end(), ctx.pqbuf.begin(), ctx.pqbuf.end());
+            publishedExact.insert(publishedExact.end(), ctx.pqbufExact.begin(), ctx.pqbufExact.end());
+            omp_unset_lock(&publishlock);
+            ctx.pqbuf.clear();
+            ctx.pqbufExact.clear();
+            state[p].store(DONE);
+         }
+         ++finished;
+      }
+      else {
+         size_t workers = (size_t)omp_get_num_threads()-1;
+         size_t polls = 0;
+         while (i < n-1 && finished < workers) {
+            if (++polls % HCLUST2_INTERRUPT_POLL == 0 && isUserInterrupt()) {
+               interrupted = true; // cannot throw from within the parallel region
+               break;
+            }
+
+            refillEdgeQueue(pq);
+            STOPIFNOT(!pq.empty())
+            HeapHierarchicalItem hhi = pq.top();
+
+            if (hhi.index2 == SIZE_MAX) {
+               size_t p = hhi.index1;
+               unsigned char expected = TODO;
+               if (!state[p].compare_exchange_strong(expected, FETCHING) && expected == FETCHING) {
+                  std::this_thread::yield(); // wait for the worker
+                  continue;
+               }
+               pq.pop();
+
+               if (expected == DONE) {
+                  omp_set_lock(&publishlock);
+                  taken.swap(published);
+                  takenExact.swap(publishedExact);
+                  omp_unset_lock(&publishlock);
+                  flushBuffer(pq, taken, takenExact);
+                  if (hhi.dist < points[p].minRadius)
+                     continue; // outdated, the new one is in pq now
+               }
+
+               getNearestNeighbors(pq, p); // buffered
+               flushBuffer(pq, ctx.pqbuf, ctx.pqbufExact);
+               state[p].store(DONE);
+               continue;
+            }
+
+            pq.pop();
+            size_t s1 = ds.find_set(hhi.index1);
+            size_t s2 = ds.find_set(hhi.index2);
+            if (s1 == s2)
+               continue;
+
+            linkClusters(hhi, s1, s2, res, links);
+            ++i;
+         }
+         stop = true;
+      }
+   }
+   bufferPushes = false;
+   omp_destroy_lock(&publishlock);
+
+   if (interrupted)
+      throw Rcpp::internal::InterruptedException();
+
+   flushBuffer(pq, published, publishedExact);
+   flushBuffers(pq);
+   MESSAGE_7("\r             merge clusters: %d / %d (pipelined)\n", i, n-1);
 #endif
+   return i;
+}
+
+
+void HClustNNbasedSingle::computeMerge(
+      HClustEdgeQueue& pq,
+      HClustResult& res,
+      std::vector<HeapHierarchicalItem>& links,
+      size_t i)
+{
+   MESSAGE_2("[%010.3f] merging clusters\n", clock()/(float)CLOCKS_PER_SEC);
+
+   // only this thread links the clusters. Once a "to be continued" item
+   // is at the top of pq, the items right behind it are popped too,
+   // up to batchMax of such items, and the corresponding points' NNs
+   // are fetched in parallel. An early search may still yield points
+   // that will be in the same cluster by the time their edges are
+   // considered, but these are skipped anyway, so the result is the same
+   // as in the sequential case. The other edges popped in the meantime
+   // are deferred: a fetched NN may come before them.
+   size_t batchMax = (MAX_THREADS_NUM > 1)?(2*(size_t)MAX_THREADS_NUM):1;
+   size_t deferredMax = 64*batchMax;
+   std::vector<size_t> batch;
+   std::vector<HeapHierarchicalItem> deferred;
+   batch.reserve(batchMax);
+   deferred.reserve(deferredMax);
+
+   // i merges have already been made (resumed or pipelined)
+   size_t compactAt = n/2; // number of clusters
+   while (compactAt > 0 && n-i <= compactAt) compactAt /= 2;
+   if (compactAt < n/2) compactIndex();
+
+   while (i < n-1)
+   {
+      refillEdgeQueue(pq);
       STOPIFNOT(!pq.empty())
       HeapHierarchicalItem hhi = pq.top();
+      pq.pop();
 
       if (hhi.index2 == SIZE_MAX) {
-         pq.pop();
-#ifdef _OPENMP
-         omp_unset_lock(&pqwritelock);
-#endif
-         getNearestNeighbors(pq, hhi.index1);
+         if (hhi.dist < points[hhi.index1].minRadius)
+            continue; // outdated (pipelined merge), the new one is in pq
+         batch.push_back(hhi.index1);
+         while (batch.size() < batchMax && deferred.size() < deferredMax) {
+            refillEdgeQueue(pq);
+            if (pq.empty()) break;
+            hhi = pq.top();
+            pq.pop();
+            if (hhi.index2 == SIZE_MAX) {
+               if (hhi.dist >= points[hhi.index1].minRadius)
+                  batch.push_back(hhi.index1);
+            }
+            else if (findCluster(hhi.index1) != findCluster(hhi.index2))
+               deferred.push_back(hhi);
+         }
+         getNearestNeighbors(pq, batch);
+         for (size_t k=0; k<deferred.size(); ++k)
+            pq.push(deferred[k]);
+         batch.clear();
+         deferred.clear();
          continue;
       }
 
       size_t s1 = ds.find_set(hhi.index1);
       size_t s2 = ds.find_set(hhi.index2);
-
       if (s1 == s2)
-      {
-         pq.pop();
-#ifdef _OPENMP
-         omp_unset_lock(&pqwritelock);
-#endif
          continue;
-      }
 
-#ifdef _OPENMP
-      omp_unset_lock(&pqwritelock); //different threads will be unable to put data into pq without it
-      #pragma omp barrier
-      #pragma omp single
-#endif
-      {
-         hhi = pq.top(); //it can change, because other threads can push something
-         pq.pop();
-         s1 = ds.find_set(hhi.index1);
-         s2 = ds.find_set(hhi.index2);
-         STOPIFNOT(s1 != s2);
-         STOPIFNOT(s2 != SIZE_MAX);
-         STOPIFNOT(hhi.index1 < hhi.index2);
-
-         res.link(indices[hhi.index1], indices[hhi.index2], hhi.dist);
-         ds.link(s1, s2);
+      STOPIFNOT(s2 != SIZE_MAX);
+      STOPIFNOT(hhi.index1 < hhi.index2);
 
-         ++i;
-         if (i == n-1)
-            go = false;/* avoids computing unnecessary nn */
-      } // #pragma omp single
-      if (MASTER_OR_SINGLE_THREAD) {
-         if (i % 512 == 0) MESSAGE_7("\r             merge clusters: %d / %d", i+1, n-1);
-         Rcpp::checkUserInterrupt(); // may throw an exception, fast op, not thread safe
+      linkClusters(hhi, s1, s2, res, links);
+
+      ++i;
+      if (i < n-1 && n-i <= compactAt) {
+         compactIndex();
+         compactAt /= 2;
       }
+
+      if (i % 512 == 0) MESSAGE_7("\r             merge clusters: %d / %d", i+1, n-1);
+      Rcpp::checkUserInterrupt(); // may throw an exception, fast op, not thread safe
    }
 
    MESSAGE_7("\r             merge clusters: %d / %d  \n", n-1, n-1);
+
+   if (checkpoint.isEnabled()) {
+      saveLinks(HCLUST2_CHECKPOINT_MERGE, links);
+      checkpoint.finish();
+   }
    Rcpp::checkUserInterrupt();
 }
 
 
+// a strict total order on the edges (index1 < index2), so that
+// the Boruvka rounds cannot introduce cycles in the case of ties
+static inline bool isShorterEdge(const HeapHierarchicalItem& a, const HeapHierarchicalItem& b)
+{
+   if (a.dist != b.dist) return a.dist < b.dist;
+   if (a.index1 != b.index1) return a.index1 < b.index1;
+   return a.index2 < b.index2;
+}
+
+
+HeapHierarchicalItem HClustNNbasedSingle::getNearestOutsideCluster(size_t index)
+{
+   size_t clusterIndex = findCluster(index);
+#ifdef GENERATE_STATS
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+   ++stats.nnCals;
+#endif
+   NNSearchContext& ctx = getSearchContext();
+   ctx.nnheap.clear();
+   ctx.nodesVisitedLimit = SIZE_MAX; // an exact search is a must here
+   ctx.cutShort = false;
+   ctx.lowest = 0;
+   ctx.minNN = 1;
+   getNearestNeighborsFromMinRadius(index, clusterIndex, points[index].minRadius, ctx);
+
+   // all the ties are reported, choose the least one
+   HeapHierarchicalItem best;
+   while (!ctx.nnheap.empty()) {
+      size_t j = ctx.nnheap.top().index;
+      HeapHierarchicalItem cur(std::min(index, j), std::max(index, j), ctx.nnheap.top().dist);
+      if (isShorterEdge(cur, best)) best = cur;
+      ctx.nnheap.pop();
+   }
+
+   // no point in another cluster will ever be closer
+   if (isfinite(best.dist))
+      points[index].minRadius = std::nextafter(best.dist, -INFINITY);
+   return best;
+}
+
+
+void HClustNNbasedSingle::computeBoruvka(HClustResult& res)
+{
+   MESSAGE_2("[%010.3f] determining the MST (Boruvka)\n", clock()/(float)CLOCKS_PER_SEC);
+
+   // each round, the shortest edge leaving each cluster is added to the MST;
+   // the NN searches are independent of each other, hence run in parallel
+   std::vector<HeapHierarchicalItem> nearest(n);
+   std::vector<HeapHierarchicalItem> shortest(n); // indexed by the clusters' ids
+   std::vector<HeapHierarchicalItem> mst;
+   mst.reserve(n-1);
+   loadLinks(HCLUST2_CHECKPOINT_BORUVKA, mst);
+   if (!mst.empty() && mst.size() < n-1) compactIndex();
+
+   while (mst.size() < n-1) {
+#ifdef _OPENMP
+      omp_set_dynamic(0); /* the runtime will not dynamically adjust the number of threads */
+      #pragma omp parallel for schedule(dynamic, HCLUST2_NN_CHUNK_SIZE)
+#endif
+      for (size_t i=0; i<n; i++) {
+         if (MASTER_OR_SINGLE_THREAD) Rcpp::checkUserInterrupt(); // may throw an exception, fast op, not thread safe
+         nearest[i] = getNearestOutsideCluster(i);
+      }
+
+      for (size_t i=0; i<n; i++)
+         shortest[i] = HeapHierarchicalItem();
+      for (size_t i=0; i<n; i++) {
+         if (nearest[i].index2 == SIZE_MAX) continue;
+         // leaves both i's and its NN's clusters
+         size_t s1 = findCluster(nearest[i].index1);
+         size_t s2 = findCluster(nearest[i].index2);
+         if (isShorterEdge(nearest[i], shortest[s1])) shortest[s1] = nearest[i];
+         if (isShorterEdge(nearest[i], shortest[s2])) shortest[s2] = nearest[i];
+      }
+
+      size_t linked = 0;
+      for (size_t s=0; s<n; s++) {
+         if (shortest[s].index2 == SIZE_MAX) continue;
+         size_t s1 = ds.find_set(shortest[s].index1);
+         size_t s2 = ds.find_set(shortest[s].index2);
+         if (s1 == s2) continue; // chosen by both clusters
+         ds.link(s1, s2);
+         mst.push_back(shortest[s]);
+         ++linked;
+      }
+      STOPIFNOT(linked > 0);
+      ++mergeEpoch; // invalidates clusterCache
+
+      MESSAGE_7("\r             Boruvka: %d / %d", mst.size(), n-1);
+      if (mst.size() < n-1) compactIndex(); // the number of clusters has at least halved
+      if (checkpoint.isDue()) saveLinks(HCLUST2_CHECKPOINT_BORUVKA, mst);
+   }
+   MESSAGE_7("\r             Boruvka: %d / %d  \n", n-1, n-1);
+
+   if (checkpoint.isEnabled()) {
+      saveLinks(HCLUST2_CHECKPOINT_BORUVKA, mst);
+      checkpoint.finish();
+   }
+
+   std::sort(mst.begin(), mst.end(), isShorterEdge);
+   for (size_t i=0; i<mst.size(); ++i)
+      res.link(indices[mst[i].index1], indices[mst[i].index2], mst[i].dist);
+}
+
+
 HClustResult HClustNNbasedSingle::compute(bool lite)
 {
-   std::priority_queue< HeapHierarchicalItem > pq;
-   // HclustPriorityQueue pq(n);
+   HClustEdgeQueue pq;
    HClustResult res(n, distance, lite);
 
 #if VERBOSE >= 5
    distance->getStats().print();
 #endif
 
-   prefetch = true;
-   computePrefetch(pq);
-   prefetch = false;
+   initSearchContexts();
+
+   if (opts->useBoruvka) {
+      computeBoruvka(res);
+   }
+   else {
+      std::vector<HeapHierarchicalItem> links; // the merges so far, for the checkpoints
+      loadLinks(HCLUST2_CHECKPOINT_MERGE, links);
+      for (size_t k=0; k<links.size(); ++k)
+         res.link(indices[links[k].index1], indices[links[k].index2], links[k].dist);
+      size_t merged = links.size();
+      if (!checkpoint.isEnabled()) links.clear();
+
+      if (merged < n-1) {
+         // see computePipelinedMerge(): it needs a worker thread
+         bool pipeline = false;
+#ifdef _OPENMP
+         pipeline = opts->usePipeline && MAX_THREADS_NUM > 1;
+#endif
+         prefetch = true;
+         bufferPushes = true;
+         if (pipeline) maxNN = minNNPrefetch; // a quick first pass
+         computePrefetch(pq);
+         maxNN = maxNNPrefetch;
+         bufferPushes = false;
+         flushBuffers(pq);
+         if (pipeline)
+            merged = computePipelinedMerge(pq, res, links, merged);
+         prefetch = false;
+      }
 
 #if VERBOSE >= 5
-   distance->getStats().print();
+      distance->getStats().print();
 #endif
 
-   computeMerge(pq, res);
+      computeMerge(pq, res, links, merged);
+   }
 
+   stats.diagnostics = getDiagnostics();
    return res;
 }
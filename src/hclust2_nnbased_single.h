@@ -29,9 +29,11 @@
 #include <R.h>
 #include <Rmath.h>
 #include <deque>
+#include <cstring>
 #include "hclust2_common.h"
 #include "disjoint_sets.h"
 #include "hclust2_result.h"
+#include "hclust2_checkpoint.h"
 
 using namespace std;
 using namespace Rcpp;
@@ -40,6 +42,216 @@ namespace grup
 {
 
 
+struct HClustPointState
+{
+   // kept together (16 bytes, 4 per cache line), as they are always
+   // read and written together; during the prefetch each point's state
+   // is written to by a single thread only
+   double minRadius;        // all the NNs closer than that have been found
+   uint32_t neighborsCount; // the number of NNs found so far
+   bool shouldFind;         // are there any more NNs to find?
+
+   HClustPointState() : minRadius(-INFINITY), neighborsCount(0), shouldFind(true) { }
+};
+
+
+struct HClustPointRadiusComparator
+{
+   const std::vector<HClustPointState>* points;
+
+   HClustPointRadiusComparator(const std::vector<HClustPointState>* points)
+      : points(points) {}
+
+   inline bool operator()(size_t a, size_t b) const {
+      return (*points)[a].minRadius < (*points)[b].minRadius;
+   }
+};
+
+
+struct HClustClusterCacheItem
+{
+   size_t cluster; // ds.find_set() result, valid as long as
+   size_t epoch;   // epoch == HClustNNbasedSingle::mergeEpoch
+
+   HClustClusterCacheItem() : cluster(SIZE_MAX), epoch(SIZE_MAX) { }
+};
+
+
+
+class HClustRadixHeap
+{
+   // a monotone priority queue of HeapCompactItems: no item smaller
+   // than the last popped key may be pushed. The keys (non-negative
+   // floats) are compared via their IEEE 754 bit patterns, which are
+   // ordered in the same way. An item goes to bucket b if the highest
+   // bit in which its key differs from the last popped one is b-1
+   // (bucket 0 stores the items equal to it). Each item moves to a lower
+   // bucket at most 32 times, hence pushes and pops are amortised O(1).
+protected:
+   static const size_t NUM_BUCKETS = 33;
+   std::vector<HeapCompactItem> buckets[NUM_BUCKETS];
+   uint32_t last;
+   size_t count;
+
+   static inline uint32_t getBits(float key) {
+      key += 0.0f; // -0.0 -> +0.0
+      uint32_t bits;
+      memcpy(&bits, &key, sizeof(bits));
+      return bits;
+   }
+
+   inline size_t getBucket(uint32_t bits) const {
+      uint32_t x = bits ^ last;
+      if (!x) return 0;
+#if defined(__GNUC__)
+      return (size_t)(32-__builtin_clz(x));
+#else
+      size_t b = 0;
+      while (x) { ++b; x >>= 1; }
+      return b;
+#endif
+   }
+
+   // makes bucket 0 nonempty: the items in the first nonempty bucket
+   // are moved to the lower ones w.r.t. their smallest key
+   void redistribute() {
+      size_t b = 1;
+      while (buckets[b].empty()) ++b;
+      std::vector<HeapCompactItem> src;
+      src.swap(buckets[b]);
+
+      last = getBits(src[0].key);
+      for (size_t k=1; k<src.size(); ++k)
+         last = std::min(last, getBits(src[k].key));
+
+      size_t counts[NUM_BUCKETS] = { 0 };
+      for (size_t k=0; k<src.size(); ++k)
+         ++counts[getBucket(getBits(src[k].key))];
+      for (size_t c=0; c<b; ++c)
+         if (counts[c] > 0)
+            buckets[c].reserve(buckets[c].size()+counts[c]);
+      for (size_t k=0; k<src.size(); ++k)
+         buckets[getBucket(getBits(src[k].key))].push_back(src[k]);
+   }
+
+public:
+   HClustRadixHeap() : last(0), count(0) { }
+
+   inline bool empty() const { return count == 0; }
+   inline size_t size() const { return count; }
+
+   // moves all the items with the smallest key to out; from now on,
+   // it is the last popped key
+   inline void popSmallest(std::vector<HeapCompactItem>& out) {
+      if (buckets[0].empty()) redistribute();
+      out.insert(out.end(), buckets[0].begin(), buckets[0].end());
+      count -= buckets[0].size();
+      buckets[0].clear();
+   }
+
+   inline void push(const HeapCompactItem& item) {
+      // the last bucket is used by assign() only (the sign bit never differs)
+      if (!buckets[NUM_BUCKETS-1].empty())
+         buckets[NUM_BUCKETS-1].push_back(item);
+      else
+         buckets[getBucket(getBits(item.key))].push_back(item);
+      ++count;
+   }
+
+   // moves the items to an empty heap at once; they are put into
+   // the last bucket, to be split by the first popSmallest()
+   void assign(std::vector<HeapCompactItem>& items) {
+      STOPIFNOT(empty());
+      last = 0;
+      count = items.size();
+      buckets[NUM_BUCKETS-1].swap(items);
+   }
+};
+
+
+
+class HClustEdgeQueue
+{
+   // the merge phase's priority queue. Most candidate edges are stored
+   // as 12-byte HeapCompactItems in a radix heap (all the compact items
+   // pushed have keys greater than exactKey, i.e., the last popped one);
+   // those with the smallest key are moved
+   // (see popSmallestKey()) to a heap of HeapHierarchicalItems with
+   // exact distances, which determines the order in which they are popped.
+   // All the keys of the compact ones are greater than exactKey then,
+   // so the order is the same as if all the distances were stored exactly.
+   // "To be continued" items (at most one per point) are stored exactly too.
+protected:
+   HClustRadixHeap edges;
+   std::priority_queue<HeapHierarchicalItem> exact;
+   std::priority_queue<HeapHierarchicalItem> pending;
+   float exactKey;
+
+   inline bool pendingFirst() const {
+      if (exact.empty()) return true;
+      if (pending.empty()) return false;
+      return exact.top() < pending.top();
+   }
+
+public:
+   HClustEdgeQueue() : edges(), exact(), pending(), exactKey(-INFINITY) { }
+
+   inline bool empty() const { return edges.empty() && exact.empty() && pending.empty(); }
+   inline size_t size() const { return edges.size() + exact.size() + pending.size(); }
+
+   // if true, popSmallestKey() must be called before top() or pop()
+   inline bool needsRefill() const { return exact.empty() && !edges.empty(); }
+
+   inline const HeapHierarchicalItem& top() const {
+      return (pendingFirst())?pending.top():exact.top();
+   }
+
+   inline void pop() {
+      if (pendingFirst()) pending.pop();
+      else exact.pop();
+   }
+
+   inline void push(const HeapHierarchicalItem& item) {
+      if (item.index2 == SIZE_MAX)
+         pending.push(item);
+      else if (HeapCompactItem::getKey(item.dist) <= exactKey)
+         exact.push(item);
+      else
+         push(HeapCompactItem(item.index1, item.index2, item.dist));
+   }
+
+   inline void push(const HeapCompactItem& item) {
+      edges.push(item);
+   }
+
+   // the caller is responsible for pushing them back via pushExact()
+   inline void popSmallestKey(std::vector<HeapCompactItem>& out) {
+      out.clear();
+      edges.popSmallest(out);
+      exactKey = out[0].key;
+   }
+
+   inline void pushExact(const HeapHierarchicalItem& item) {
+      exact.push(item);
+   }
+
+   // whether item may be pushed as is; otherwise, it must be pushed
+   // via pushExact(), as its key is not greater than exactKey
+   inline bool acceptsCompact(const HeapCompactItem& item) const {
+      return item.key > exactKey;
+   }
+
+   // moves the items to an empty queue at once
+   void assign(std::vector<HeapCompactItem>& newEdges, std::vector<HeapHierarchicalItem>& newPending) {
+      STOPIFNOT(empty());
+      edges.assign(newEdges);
+      std::priority_queue<HeapHierarchicalItem> pending2(
+         std::less<HeapHierarchicalItem>(), std::move(newPending));
+      pending.swap(pending2);
+   }
+};
+
+
 
 class HClustNNbasedSingle
 {
@@ -50,9 +262,7 @@ protected:
    Distance* distance;
    std::vector<size_t> indices;
 
-   std::vector<size_t> neighborsCount;
-   std::vector<double> minRadiuses;
-   std::vector<bool> shouldFind;
+   std::vector<HClustPointState> points; // one per point
 
    HClustStats stats;
 
@@ -62,12 +272,56 @@ protected:
 
    DisjointSets ds;
    bool prefetch;
+   bool bufferPushes; // pushNearestNeighbors() fills the per-thread buffers instead of pq
+   size_t maxNN;      // the number of NNs collected by a single query
+   size_t maxNNPrefetch; // opts->maxNNPrefetch etc. capped so that the prefetched
+   size_t minNNPrefetch; // edges fit in opts->memoryLimitMB
+   size_t minNNMerge;
+   size_t mergeEpoch; // number of merges so far
+   std::vector<HClustClusterCacheItem> clusterCache; // one per point
+   std::vector<HeapCompactItem> refillBuf;
+   HClustCheckpoint checkpoint;
+
+   // ds.find_set(i), memoised until the next merge (ds changes only in
+   // computeMerge's single-threaded section); a stale value read by another
+   // thread is an ancestor of i anyway, so it never makes two different
+   // clusters look the same
+   inline size_t findCluster(size_t i) {
+      HClustClusterCacheItem& c = clusterCache[i];
+      if (c.epoch != mergeEpoch) {
+         c.cluster = ds.find_set(i);
+         c.epoch = mergeEpoch;
+      }
+      return c.cluster;
+   }
+
+   std::vector<NNSearchContext*> contexts; // one per thread
+
+   virtual NNSearchContext* createSearchContext() { return new NNSearchContext(opts); }
+   void initSearchContexts();
+   inline NNSearchContext& getSearchContext() { return *contexts[CURRENT_THREAD_NUM]; }
 
-   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNHeap& nnheap) = 0;
-   void getNearestNeighbors(std::priority_queue<HeapHierarchicalItem> & pq, size_t index);
+   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx) = 0;
+   void getNearestNeighbors(HClustEdgeQueue& pq, size_t index);
+   void getNearestNeighbors(HClustEdgeQueue& pq, const std::vector<size_t>& batch);
+   void pushNearestNeighbors(HClustEdgeQueue& pq, size_t index, NNHeap& nnheap);
 
-   void computePrefetch(std::priority_queue<HeapHierarchicalItem> & pq);
-   void computeMerge(std::priority_queue<HeapHierarchicalItem> & pq, HClustResult& res);
+   void computePrefetch(HClustEdgeQueue& pq);
+   void flushBuffer(HClustEdgeQueue& pq, std::vector<HeapCompactItem>& edges, std::vector<HeapHierarchicalItem>& items);
+   void flushBuffers(HClustEdgeQueue& pq);
+   virtual void compactIndex() { } // called during the merge phase, single-threaded
+   virtual Rcpp::RObject getDiagnostics() { return R_NilValue; }
+   void refillEdgeQueue(HClustEdgeQueue& pq);
+   void saveLinks(size_t phase, const std::vector<HeapHierarchicalItem>& links);
+   void loadLinks(size_t phase, std::vector<HeapHierarchicalItem>& links);
+   void linkClusters(const HeapHierarchicalItem& hhi, size_t s1, size_t s2,
+      HClustResult& res, std::vector<HeapHierarchicalItem>& links);
+   size_t computePipelinedMerge(HClustEdgeQueue& pq, HClustResult& res,
+      std::vector<HeapHierarchicalItem>& links, size_t i);
+   void computeMerge(HClustEdgeQueue& pq, HClustResult& res,
+      std::vector<HeapHierarchicalItem>& links, size_t i);
+   HeapHierarchicalItem getNearestOutsideCluster(size_t index);
+   void computeBoruvka(HClustResult& res);
 
 
 public:
@@ -33,7 +33,7 @@ RObject hclust2_gini(RObject distance, RObject objects, RObject control=R_NilVal
       grup::NNHeap::setOptions(&opts);
 
       grup::HClustMSTbasedGini hclust(dist, &opts);
-      grup::HClustResult result2 = grup::HClustMSTbasedGini(dist, &opts).compute();
+      grup::HClustResult result2 = hclust.compute();
       result = Rcpp::as<Rcpp::RObject>(
          result2.toR(hclust.getStats(), hclust.getOptions(), dist->getStats())
       );
@@ -147,7 +147,8 @@ List HClustResult::toR(
       _["links"]  = links,
       _["stats"] = List::create(
          _["method"] = hclustStats.toR(),
-         _["distance"] = distStats.toR()
+         _["distance"] = distStats.toR(),
+         _["diagnostics"] = hclustStats.diagnostics
       ),
       _["control"] = List::create(
          _["method"] = hclustOptions.toR()
@@ -26,13 +26,20 @@ using namespace grup;
 // constructor (OK, we all know what this is, but I label it for faster in-code search)
 HClustVpTreeSingle::HClustVpTreeSingle(Distance* dist, HClustOptions* opts) :
       HClustNNbasedSingle(dist, opts),
-      root(NULL)
+      root(NULL),
+      depth(0),
+      npivots(opts->vpPivots)
 //    visitAll(false)
 {
    MESSAGE_2("[%010.3f] building vp-tree\n", clock()/(float)CLOCKS_PER_SEC);
 
+   if (npivots > 0) {
+      pivots.resize(n*npivots);
+      pivotRing.resize(n*npivots);
+   }
    std::vector<double> distances(n);
    root = buildFromPoints(0, n, distances);
+   std::vector<double>().swap(pivotRing); // free
 }
 
 
@@ -114,175 +121,464 @@ size_t HClustVpTreeSingle::chooseNewVantagePoint(size_t left, size_t right)
 
 
 HClustVpTreeSingleNode* HClustVpTreeSingle::buildFromPoints(size_t left,
-   size_t right, std::vector<double>& distances)
+   size_t right, std::vector<double>& distances, size_t level)
 {
 #ifdef GENERATE_STATS
    ++stats.nodeCount;
 #endif
+   if (level > depth) depth = level;
    if (right - left <= opts->maxLeavesElems)
    {
    #ifdef GENERATE_STATS
       ++stats.leafCount;
    #endif
       HClustVpTreeSingleNode* leaf = new HClustVpTreeSingleNode(left, right);
+      leaf->level = level;
       leaf->maxindex = right-1; // left < right-1
+      // distances to the nearest ancestor vantage points, the parent's one first
+      for (size_t i=left; i<right; ++i) {
+         for (size_t t=0; t<std::min(npivots, level); ++t)
+            pivots[i*npivots+t] = pivotRing[indices[i]*npivots+(level-1-t)%npivots];
+      }
+      leaves.push_back(leaf);
       return leaf;
    }
 
    size_t vpi_idx = chooseNewVantagePoint(left, right);
    std::swap(indices[left], indices[vpi_idx]);
    size_t vpi = indices[left];
-   size_t median = (right + left) / 2;
 
    for (size_t i=left+1; i<right; ++i)
       distances[indices[i]] = (*distance)(vpi, indices[i]);
+   if (npivots > 0) {
+      for (size_t i=left+1; i<right; ++i)
+         pivotRing[indices[i]*npivots+level%npivots] = distances[indices[i]];
+   }
 
-   // std::sort(indices.begin()+left+1, indices.begin()+right, DistanceComparatorCached(&distances));
-   std::nth_element(indices.begin()+left+1, indices.begin() + median, indices.begin()+right, DistanceComparatorCached(&distances));
-
-// slower -- computes some distances > 1 time
-//    std::nth_element(indices.begin() + left + 1, indices.begin() + median,  indices.begin() + right,
-//                     DistanceComparator(vpi, distance));
-//    HClustVpTreeSingleNode* node = new HClustVpTreeSingleNode(vpi, left, left+1, (*distance)(vpi, indices[median]));
-
-   HClustVpTreeSingleNode* node = new HClustVpTreeSingleNode(vpi, left, left+1, distances[indices[median]]);
-
+   HClustVpTreeSingleNode* node = new HClustVpTreeSingleNode(vpi, left, left+1);
+   node->level = level;
    node->maxindex = left;
-   if (median - left > 0) { // don't include vpi
-      node->childL = buildFromPoints(left+1, median+1, distances);
-      if (node->childL->maxindex > node->maxindex)
-         node->maxindex = node->childL->maxindex;
+
+   // split the remaining points (vpi excluded) into opts->vpFanout shells
+   // of (almost) equal sizes w.r.t. their distances to the vantage point;
+   // for vpFanout == 2, the first shell is within the median distance
+   size_t count = right-left-1;
+   std::vector<size_t> shells; // shells[j] - the first position of the j-th shell
+   for (size_t j=0; j<opts->vpFanout; ++j) {
+      size_t from = left+1+(count*j+opts->vpFanout-1)/opts->vpFanout;
+      size_t to   = left+1+(count*(j+1)+opts->vpFanout-1)/opts->vpFanout;
+      if (from == to) continue; // too few points
+      if (to < right)
+         std::nth_element(indices.begin()+from, indices.begin()+to,
+            indices.begin()+right, DistanceComparatorCached(&distances));
+      shells.push_back(from);
+
+      double lo = INFINITY, hi = -INFINITY;
+      for (size_t i=from; i<to; ++i) {
+         if (distances[indices[i]] < lo) lo = distances[indices[i]];
+         if (distances[indices[i]] > hi) hi = distances[indices[i]];
+      }
+      node->bounds.push_back(lo);
+      node->bounds.push_back(hi);
    }
-   if (right - median - 1 > 0) {
-      node->childR = buildFromPoints(median+1, right, distances);
-      if (node->childR->maxindex > node->maxindex)
-         node->maxindex = node->childR->maxindex;
+   shells.push_back(right);
+
+   // recursive calls overwrite distances, which are not needed anymore
+   for (size_t j=0; j+1<shells.size(); ++j) {
+      HClustVpTreeSingleNode* child = buildFromPoints(shells[j], shells[j+1], distances, level+1);
+      node->children.push_back(child);
+      if (child->maxindex > node->maxindex)
+         node->maxindex = child->maxindex;
    }
 
    return node;
 }
 
 
-void HClustVpTreeSingle::getNearestNeighborsFromMinRadiusRecursiveLeaf(
-   HClustVpTreeSingleNode* node, size_t index,
-   size_t clusterIndex, double minR, std::priority_queue<double>& bestR, double& maxR, NNHeap& nnheap)
+void HClustVpTreeSingle::getNearestNeighborsFromMinRadiusLeaf(
+   HClustVpTreeSingleNode* node, size_t index, size_t lowest,
+   size_t clusterIndex, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap,
+   const double* qpivots, size_t nqpivots)
 {
    STOPIFNOT(node->vpindex == SIZE_MAX);
-   if (!prefetch && !node->sameCluster) {
-      size_t commonCluster = ds.find_set(node->left);
+   if (!prefetch && !node->sameCluster && !node->runs.empty()) {
+      // compacted: all the elements in a group share the same cluster
+      size_t commonCluster = findCluster(node->members[0]);
+      for (size_t r=0; r+1<node->runs.size(); ++r) {
+         size_t currentCluster = findCluster(node->members[node->runs[r]]);
+         if (currentCluster != commonCluster) commonCluster = SIZE_MAX;
+         if (currentCluster == clusterIndex) continue;
+         for (size_t k=node->runs[r]; k<node->runs[r+1]; ++k)
+            getNearestNeighborsFromMinRadiusLeafElement(node->members[k], index, lowest,
+               minR, bestR, maxR, nnheap, qpivots, nqpivots);
+      }
+      if (commonCluster != SIZE_MAX)
+         node->sameCluster = true;
+   }
+   else if (!prefetch && !node->sameCluster) {
+      size_t commonCluster = findCluster(node->left);
       for (size_t i=node->left; i<node->right; ++i) {
-         size_t currentCluster = ds.find_set(i);
+         size_t currentCluster = findCluster(i);
          if (currentCluster != commonCluster) commonCluster = SIZE_MAX;
          if (currentCluster == clusterIndex) continue;
-         if (index >= i) continue;
-         double dist2 = (*distance)(indices[index], indices[i]); // the slow part
-         if (dist2 > maxR || dist2 <= minR) continue;
-         if (dist2 < bestR.top()) { bestR.pop(); bestR.push(dist2); }
-
-         nnheap.insert(i, dist2, maxR);
+         getNearestNeighborsFromMinRadiusLeafElement(i, index, lowest,
+            minR, bestR, maxR, nnheap, qpivots, nqpivots);
       }
       if (commonCluster != SIZE_MAX)
          node->sameCluster = true; // set to true (btw, may be true already)
    }
    else /* node->sameCluster */ {
-      for (size_t i=node->left; i<node->right; ++i) {
-         if (index >= i) continue;
-         double dist2 = (*distance)(indices[index], indices[i]); // the slow part
-         if (dist2 > maxR || dist2 <= minR) continue;
-         if (dist2 < bestR.top()) { bestR.pop(); bestR.push(dist2); }
-
-         nnheap.insert(i, dist2, maxR);
-      }
+      for (size_t i=node->left; i<node->right; ++i)
+         getNearestNeighborsFromMinRadiusLeafElement(i, index, lowest,
+            minR, bestR, maxR, nnheap, qpivots, nqpivots);
    }
 }
 
 
-void HClustVpTreeSingle::getNearestNeighborsFromMinRadiusRecursiveNonLeaf(
-   HClustVpTreeSingleNode* node, size_t index,
-   size_t clusterIndex, double minR, std::priority_queue<double>& bestR, double& maxR, NNHeap& nnheap)
+void HClustVpTreeSingle::getNearestNeighborsFromMinRadius(
+   size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx)
 {
-   STOPIFNOT(node->vpindex != SIZE_MAX);
-
-   // first visit the vantage point
-   double dist = (*distance)(indices[index], indices[node->left]); // the slow part
-   if (index < node->left && dist <= maxR && dist > minR &&
-         ds.find_set(node->left) != clusterIndex) {
-      if (dist < bestR.top()) { bestR.pop(); bestR.push(dist); }
-      nnheap.insert(node->left, dist, maxR);
+   // search within (minR, maxR]
+   // depth-first, the nearest child first; the traversal stack is explicit:
+   // state 0 - node not visited yet,
+   // state 1 - vantage point processed, the children marked in
+   //           the `visited` bit mask processed or pruned;
+   // see getNearestNeighborsFromMinRadiusBestFirst() for the alternative
+   if (opts->vpBestFirst || ctx.nodesVisitedLimit != SIZE_MAX) {
+      getNearestNeighborsFromMinRadiusBestFirst(index, clusterIndex, minR, ctx);
+      return;
    }
 
-//    if (visitAll) {
-//       if (node->childL && index < node->childL->maxindex)
-//          getNearestNeighborsFromMinRadiusRecursive(node->childL, index, clusterIndex, minR, maxR, nnheap);
-//       if (node->childR && index < node->childR->maxindex)
-//          getNearestNeighborsFromMinRadiusRecursive(node->childR, index, clusterIndex, minR, maxR, nnheap);
-//    }
-//    else {
-      if (dist < node->radius) {
-         if (node->childL && index < node->childL->maxindex && dist + node->radius > minR) {
-            // double cutR = dist - node->radius;
-            //STOPIFNOT(maxR >= cutR);
-            //STOPIFNOT(!(bestR.top() < cutR));
-            getNearestNeighborsFromMinRadiusRecursive(node->childL, index, clusterIndex, minR, bestR, maxR, nnheap);
+   std::vector<HClustVpTreeSingleStackItem>& stack =
+      static_cast<HClustVpTreeSingleContext&>(ctx).stack;
+   std::vector<double>& qpivots =
+      static_cast<HClustVpTreeSingleContext&>(ctx).qpivots;
+   std::vector<HClustVpTreeSingleLevelStats>& levelStats =
+      static_cast<HClustVpTreeSingleContext&>(ctx).levelStats;
+   NNBestRadii& bestR = ctx.bestR;
+   NNHeap& nnheap = ctx.nnheap;
+   bestR.reset(ctx.minNN);
+   size_t lowest = ctx.lowest;
+   double maxR = INFINITY;
+
+   stack.clear(); // capacity is retained
+   stack.push_back(HClustVpTreeSingleStackItem(root));
+   while (!stack.empty()) {
+      HClustVpTreeSingleStackItem& cur = stack.back();
+      HClustVpTreeSingleNode* node = cur.node;
+      STOPIFNOT(node != NULL);
+
+      if (cur.state == 0) {
+         #ifdef GENERATE_STATS
+         #ifdef _OPENMP
+         #pragma omp atomic
+         #endif
+            ++stats.nodeVisit;
+         #endif
+         if (!levelStats.empty()) ++levelStats[node->level].visits;
+
+         if (!prefetch && node->sameCluster && clusterIndex == findCluster(node->left)) {
+            stack.pop_back();
+            continue;
          }
 
-         if (node->childR && index < node->childR->maxindex) {
-            double cutR = node->radius - dist;
-            if (maxR >= cutR) {
-               if (bestR.top() < cutR) {
-                  while (!nnheap.empty() && nnheap.top().dist > cutR) {
-                     nnheap.pop();
-                  }
-                  maxR = cutR;
-               }
-               else
-                  getNearestNeighborsFromMinRadiusRecursive(node->childR, index, clusterIndex, minR, bestR, maxR, nnheap);
-            }
+         if (node->vpindex == SIZE_MAX) { // leaf
+            if (!levelStats.empty()) levelStats[node->level].scanned += node->right-node->left;
+            // the stack holds the path from the root, hence
+            // the distances to the nearest ancestor vantage points
+            size_t nqpivots = std::min(npivots, stack.size()-1);
+            for (size_t t=0; t<nqpivots; ++t)
+               qpivots[t] = stack[stack.size()-2-t].dist;
+            getNearestNeighborsFromMinRadiusLeaf(node, index, lowest, clusterIndex,
+               minR, bestR, maxR, nnheap, qpivots.data(), nqpivots);
+            stack.pop_back();
+            continue;
          }
+
+         // first visit the vantage point
+         double dist = (*distance)(indices[index], indices[node->left]); // the slow part
+         if (lowest <= node->left && dist <= maxR && dist > minR &&
+               (prefetch || findCluster(node->left) != clusterIndex)) {
+            if (dist < bestR.top()) bestR.replaceTop(dist);
+            nnheap.insert(node->left, dist, maxR);
+         }
+
+         cur.dist = dist;
+         cur.state = 1;
+         if (!levelStats.empty()) levelStats[node->level+1].considered += node->children.size();
       }
-      else /* ( dist >= node->radius ) */ {
-         if (node->childR && index < node->childR->maxindex) {
-            // double cutR = node->radius - dist;
-            //STOPIFNOT(maxR >= cutR);
-            //STOPIFNOT(!(bestR.top() < cutR));
-            getNearestNeighborsFromMinRadiusRecursive(node->childR, index, clusterIndex, minR, bestR, maxR, nnheap);
+      else /* cur.state == 1 */ {
+         // the unvisited child with the smallest lower bound goes next
+         double dist = cur.dist;
+         size_t next = SIZE_MAX;
+         double nextR = INFINITY;
+         for (size_t j=0; j<node->children.size(); ++j) {
+            if (cur.visited & ((size_t)1<<j)) continue;
+            if (node->children[j]->maxindex < lowest ||
+                  node->upperBound(j, dist) <= minR) {
+               cur.visited |= ((size_t)1<<j);
+               continue;
+            }
+            double cutR = node->lowerBound(j, dist);
+            if (cutR < nextR) {
+               nextR = cutR;
+               next = j;
+            }
          }
 
-         if (node->childL && index < node->childL->maxindex && dist + node->radius > minR) {
-            double cutR = dist - node->radius;
-            if (maxR >= cutR) {
-               if (bestR.top() < cutR) {
-                  while (!nnheap.empty() && nnheap.top().dist > cutR) {
-                     nnheap.pop();
-                  }
-                  maxR = cutR;
+         if (next != SIZE_MAX && maxR >= nextR) {
+            if (bestR.top() < nextR) {
+               // the remaining subtrees may include points exactly nextR away
+               while (!nnheap.empty() && nnheap.top().dist >= nextR) {
+                  nnheap.pop();
                }
-               else
-                  getNearestNeighborsFromMinRadiusRecursive(node->childL, index, clusterIndex, minR, bestR, maxR, nnheap);
+               maxR = std::nextafter(nextR, -INFINITY);
+            }
+            else {
+               cur.visited |= ((size_t)1<<next);
+               // `cur` may be invalidated below
+               stack.push_back(HClustVpTreeSingleStackItem(node->children[next]));
+               continue;
             }
          }
+
+         // all the remaining children are too far away
+         stack.pop_back();
+         updateSameClusterFlag(node);
+      }
+   }
+}
+
+
+void HClustVpTreeSingle::getNearestNeighborsFromMinRadiusBestFirst(
+   size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx)
+{
+   // search within (minR, maxR]
+   // best-first: nodes are visited in the order of increasing lower bounds
+   // for the distances between the query point and their elements;
+   // used if opts->vpBestFirst is set or in the approximate search mode,
+   // where it stops after visiting ctx.nodesVisitedLimit nodes
+   std::vector<HClustVpTreeSingleQueueItem>& queue =
+      static_cast<HClustVpTreeSingleContext&>(ctx).queue;
+   std::vector<HClustVpTreeSinglePathItem>& queuePath =
+      static_cast<HClustVpTreeSingleContext&>(ctx).queuePath;
+   std::vector<double>& qpivots =
+      static_cast<HClustVpTreeSingleContext&>(ctx).qpivots;
+   std::vector<HClustVpTreeSingleLevelStats>& levelStats =
+      static_cast<HClustVpTreeSingleContext&>(ctx).levelStats;
+   NNBestRadii& bestR = ctx.bestR;
+   NNHeap& nnheap = ctx.nnheap;
+   bestR.reset(ctx.minNN);
+   size_t lowest = ctx.lowest;
+   double maxR = INFINITY;
+   size_t nodesVisited = 0;
+
+   queue.clear(); // capacity is retained
+   queuePath.clear();
+   queue.push_back(HClustVpTreeSingleQueueItem(root, 0.0));
+   while (!queue.empty()) {
+      std::pop_heap(queue.begin(), queue.end());
+      HClustVpTreeSingleQueueItem cur = queue.back();
+      queue.pop_back();
+
+      if (cur.lb > maxR)
+         break; // the remaining nodes are even further away
+
+      if (bestR.top() < cur.lb) {
+         // minNN NNs found already and all the remaining points are
+         // at least cur.lb away -- the NNs are complete within [0, cur.lb)
+         while (!nnheap.empty() && nnheap.top().dist >= cur.lb) {
+            nnheap.pop();
+         }
+         break;
+      }
+
+      if (nodesVisited >= ctx.nodesVisitedLimit) {
+         ctx.cutShort = true;
+         break;
+      }
+      ++nodesVisited;
+
+      HClustVpTreeSingleNode* node = cur.node;
+      STOPIFNOT(node != NULL);
+      #ifdef GENERATE_STATS
+      #ifdef _OPENMP
+      #pragma omp atomic
+      #endif
+         ++stats.nodeVisit;
+      #endif
+      if (!levelStats.empty()) ++levelStats[node->level].visits;
+
+      if (!prefetch && node->sameCluster && clusterIndex == findCluster(node->left))
+         continue;
+
+      if (node->vpindex == SIZE_MAX) { // leaf
+         if (!levelStats.empty()) levelStats[node->level].scanned += node->right-node->left;
+         // follow the path to the root to get the distances
+         // to the nearest ancestor vantage points
+         size_t nqpivots = 0;
+         for (size_t p=cur.path; p != SIZE_MAX && nqpivots < npivots; p=queuePath[p].parent)
+            qpivots[nqpivots++] = queuePath[p].dist;
+         getNearestNeighborsFromMinRadiusLeaf(node, index, lowest, clusterIndex,
+            minR, bestR, maxR, nnheap, qpivots.data(), nqpivots);
+         continue;
+      }
+
+      double dist = (*distance)(indices[index], indices[node->left]); // the slow part
+      if (lowest <= node->left && dist <= maxR && dist > minR &&
+            (prefetch || findCluster(node->left) != clusterIndex)) {
+         if (dist < bestR.top()) bestR.replaceTop(dist);
+         nnheap.insert(node->left, dist, maxR);
+      }
+
+      size_t path = queuePath.size();
+      queuePath.push_back(HClustVpTreeSinglePathItem(cur.path, dist));
+      if (!levelStats.empty()) levelStats[node->level+1].considered += node->children.size();
+
+      for (size_t j=0; j<node->children.size(); ++j) {
+         if (node->children[j]->maxindex < lowest || node->upperBound(j, dist) <= minR)
+            continue;
+         double lb = std::max(cur.lb, node->lowerBound(j, dist));
+         if (lb <= maxR) {
+            queue.push_back(HClustVpTreeSingleQueueItem(node->children[j], lb, path));
+            std::push_heap(queue.begin(), queue.end());
+         }
+      }
+
+      updateSameClusterFlag(node);
+   }
+}
+
+
+void HClustVpTreeSingle::compactIndex()
+{
+   // as clusters grow, group each mixed leaf's elements by cluster so that
+   // a leaf scan needs a single cluster lookup per group and skips
+   // the query's own cluster at once; clusters are only merged, hence
+   // a group never becomes mixed, but two groups may come to share a cluster;
+   // smaller leaves seldom hold two elements of the same cluster
+   if (opts->maxLeavesElems < HCLUST2_COMPACT_MIN_LEAF_ELEMS) return;
+
+   std::vector< std::pair<size_t, size_t> > elems; // (cluster, position)
+   for (size_t l=0; l<leaves.size(); l++) {
+      HClustVpTreeSingleNode* leaf = leaves[l];
+      std::vector<size_t>().swap(leaf->members); // free
+      std::vector<size_t>().swap(leaf->runs);
+      if (leaf->sameCluster) continue;
+
+      elems.clear();
+      for (size_t i=leaf->left; i<leaf->right; ++i)
+         elems.push_back(std::make_pair(findCluster(i), i));
+      std::sort(elems.begin(), elems.end());
+
+      size_t nruns = 1;
+      for (size_t k=1; k<elems.size(); ++k)
+         if (elems[k].first != elems[k-1].first) ++nruns;
+
+      if (nruns == 1)
+         leaf->sameCluster = true;
+      else if (nruns < elems.size()) { // otherwise nothing to gain
+         leaf->members.reserve(elems.size());
+         leaf->runs.reserve(nruns+1);
+         for (size_t k=0; k<elems.size(); ++k) {
+            if (k == 0 || elems[k].first != elems[k-1].first)
+               leaf->runs.push_back(k);
+            leaf->members.push_back(elems[k].second);
+         }
+         leaf->runs.push_back(elems.size());
+      }
+   }
+}
+
+
+Rcpp::RObject HClustVpTreeSingle::getDiagnostics()
+{
+   if (!opts->vpDiagnostics) return R_NilValue;
+
+   // the tree's shape
+   std::vector<double> level(depth+1), nodes(depth+1, 0.0), leaves(depth+1, 0.0),
+      leafElems(depth+1, 0.0), radiusMin(depth+1, INFINITY),
+      radiusMean(depth+1, 0.0), radiusMax(depth+1, -INFINITY);
+   std::vector<double> leafSize(opts->maxLeavesElems), leafCount(opts->maxLeavesElems, 0.0);
+   std::vector<HClustVpTreeSingleNode*> todo(1, root);
+   while (!todo.empty()) {
+      HClustVpTreeSingleNode* node = todo.back();
+      todo.pop_back();
+      size_t l = node->level;
+      ++nodes[l];
+      if (node->vpindex == SIZE_MAX) {
+         ++leaves[l];
+         leafElems[l] += node->right-node->left;
+         if (node->right > node->left) ++leafCount[node->right-node->left-1];
+         continue;
       }
-//   }
+      // the first shell's outer bound (the median distance for vpFanout == 2)
+      double radius = node->bounds[1];
+      radiusMin[l] = std::min(radiusMin[l], radius);
+      radiusMax[l] = std::max(radiusMax[l], radius);
+      radiusMean[l] += radius;
+      for (size_t j=0; j<node->children.size(); ++j)
+         todo.push_back(node->children[j]);
+   }
+
+   // the searches
+   std::vector<double> visits(depth+1, 0.0), considered(depth+1, 0.0), scanned(depth+1, 0.0);
+   for (size_t t=0; t<contexts.size(); ++t) {
+      if (!contexts[t]) continue;
+      const std::vector<HClustVpTreeSingleLevelStats>& levelStats =
+         static_cast<HClustVpTreeSingleContext*>(contexts[t])->levelStats;
+      for (size_t l=0; l<levelStats.size(); ++l) {
+         visits[l] += levelStats[l].visits;
+         considered[l] += levelStats[l].considered;
+         scanned[l] += levelStats[l].scanned;
+      }
+   }
 
-   updateSameClusterFlag(node);
+   considered[0] = visits[0]; // the root is always considered
+   std::vector<double> pruned(depth+1);
+   for (size_t l=0; l<=depth; ++l) {
+      level[l] = l;
+      pruned[l] = considered[l]-visits[l];
+      if (nodes[l] > leaves[l])
+         radiusMean[l] /= (nodes[l]-leaves[l]);
+      else
+         radiusMin[l] = radiusMean[l] = radiusMax[l] = NA_REAL;
+   }
+   for (size_t k=0; k<leafSize.size(); ++k)
+      leafSize[k] = k+1;
+
+   return Rcpp::List::create(
+      Rcpp::_["levels"] = Rcpp::DataFrame::create(
+         Rcpp::_["level"]      = Rcpp::wrap(level),
+         Rcpp::_["nodes"]      = Rcpp::wrap(nodes),
+         Rcpp::_["leaves"]     = Rcpp::wrap(leaves),
+         Rcpp::_["leafElems"]  = Rcpp::wrap(leafElems),
+         Rcpp::_["radiusMin"]  = Rcpp::wrap(radiusMin),
+         Rcpp::_["radiusMean"] = Rcpp::wrap(radiusMean),
+         Rcpp::_["radiusMax"]  = Rcpp::wrap(radiusMax),
+         Rcpp::_["visits"]     = Rcpp::wrap(visits),
+         Rcpp::_["considered"] = Rcpp::wrap(considered),
+         Rcpp::_["pruned"]     = Rcpp::wrap(pruned),
+         Rcpp::_["scanned"]    = Rcpp::wrap(scanned)
+      ),
+      Rcpp::_["leafSizes"] = Rcpp::DataFrame::create(
+         Rcpp::_["size"]  = Rcpp::wrap(leafSize),
+         Rcpp::_["count"] = Rcpp::wrap(leafCount)
+      )
+   );
 }
 
 
 void HClustVpTreeSingle::updateSameClusterFlag(HClustVpTreeSingleNode* node)
 {
-   if (prefetch || node->sameCluster ||
-      (node->childL && !node->childL->sameCluster) ||
-      (node->childR && !node->childR->sameCluster)
-   ) return;
+   if (prefetch || node->sameCluster) return;
+   for (size_t j=0; j<node->children.size(); ++j)
+      if (!node->children[j]->sameCluster) return;
 
    // otherwise check if node->sameCluster flag needs updating
-   size_t commonCluster = ds.find_set(node->left);
-   if (node->childL) {
-      size_t currentCluster = ds.find_set(node->childL->left);
-      if (currentCluster != commonCluster) return; // not ready yet
-   }
-   if (node->childR) {
-      size_t currentCluster = ds.find_set(node->childR->left);
+   size_t commonCluster = findCluster(node->left);
+   for (size_t j=0; j<node->children.size(); ++j) {
+      size_t currentCluster = findCluster(node->children[j]->left);
       if (currentCluster != commonCluster) return; // not ready yet
    }
    node->sameCluster = true;
@@ -290,15 +586,11 @@ void HClustVpTreeSingle::updateSameClusterFlag(HClustVpTreeSingleNode* node)
 
 
 void HClustVpTreeSingle::print(HClustVpTreeSingleNode* node) {
-   if (node->childL) {
-      Rprintf("\"%llx\" -> \"%llx\" [label=\"L\"];\n",
-         (unsigned long long)node, (unsigned long long)(node->childL));
-      print(node->childL);
-   }
-   if (node->childR) {
-      Rprintf("\"%llx\" -> \"%llx\" [label=\"R\"];\n",
-         (unsigned long long)node, (unsigned long long)(node->childR));
-      print(node->childR);
+   for (size_t j=0; j<node->children.size(); ++j) {
+      Rprintf("\"%llx\" -> \"%llx\" [label=\"[%g, %g]\"];\n",
+         (unsigned long long)node, (unsigned long long)(node->children[j]),
+         node->bounds[2*j], node->bounds[2*j+1]);
+      print(node->children[j]);
    }
 
    if (node->vpindex == SIZE_MAX) {
@@ -306,7 +598,7 @@ void HClustVpTreeSingle::print(HClustVpTreeSingleNode* node) {
          Rprintf("\"%llx\" -> \"%llu\" [arrowhead = diamond];\n", (unsigned long long)node, (unsigned long long)indices[i]+1);
    }
    else {
-      Rprintf("\"%llx\" [label=\"(%llu, %g)\"];\n", (unsigned long long)node, (unsigned long long)node->vpindex+1, node->radius);
+      Rprintf("\"%llx\" [label=\"%llu\"];\n", (unsigned long long)node, (unsigned long long)node->vpindex+1);
    }
 }
 
@@ -35,27 +35,113 @@ struct HClustVpTreeSingleNode
    size_t vpindex;
    size_t left;
    size_t right;
-   double radius;
+   size_t level;
    bool sameCluster;
    size_t maxindex;
-   HClustVpTreeSingleNode* childL;
-   HClustVpTreeSingleNode* childR;
+   // children[j]'s elements are between bounds[2*j] and bounds[2*j+1]
+   // away from the vantage point (a shell); shells are sorted w.r.t. distances
+   std::vector<HClustVpTreeSingleNode*> children;
+   std::vector<double> bounds;
+   // leaves only, see HClustVpTreeSingle::compactIndex(): positions grouped
+   // by cluster, the r-th group is members[runs[r]], ..., members[runs[r+1]-1]
+   std::vector<size_t> members;
+   std::vector<size_t> runs;
 
    HClustVpTreeSingleNode() :
-         vpindex(SIZE_MAX), left(SIZE_MAX), right(SIZE_MAX), radius(-INFINITY),
-         sameCluster(false), maxindex(SIZE_MAX), childL(NULL), childR(NULL)  { }
+         vpindex(SIZE_MAX), left(SIZE_MAX), right(SIZE_MAX), level(0),
+         sameCluster(false), maxindex(SIZE_MAX), children(), bounds(),
+         members(), runs()  { }
 
    HClustVpTreeSingleNode(size_t left, size_t right) :
-         vpindex(SIZE_MAX), left(left), right(right), radius(-INFINITY),
-         sameCluster(false), maxindex(SIZE_MAX), childL(NULL), childR(NULL)  { }
+         vpindex(SIZE_MAX), left(left), right(right), level(0),
+         sameCluster(false), maxindex(SIZE_MAX), children(), bounds(),
+         members(), runs()  { }
 
-   HClustVpTreeSingleNode(size_t vpindex, size_t left, size_t right, double radius) :
-         vpindex(vpindex), left(left), right(right), radius(radius),
-         sameCluster(false), maxindex(SIZE_MAX), childL(NULL), childR(NULL)  { }
+   HClustVpTreeSingleNode(size_t vpindex, size_t left, size_t right) :
+         vpindex(vpindex), left(left), right(right), level(0),
+         sameCluster(false), maxindex(SIZE_MAX), children(), bounds(),
+         members(), runs()  { }
 
    ~HClustVpTreeSingleNode() {
-      if (childL) delete childL;
-      if (childR) delete childR;
+      for (size_t j=0; j<children.size(); ++j)
+         delete children[j];
+   }
+
+   // lower bound for the distance between a point dist away
+   // from the vantage point and children[j]'s elements (may be negative)
+   inline double lowerBound(size_t j, double dist) const {
+      return std::max(bounds[2*j]-dist, dist-bounds[2*j+1]);
+   }
+
+   // upper bound for the same distance
+   inline double upperBound(size_t j, double dist) const {
+      return dist+bounds[2*j+1];
+   }
+};
+
+
+struct HClustVpTreeSingleStackItem
+{
+   HClustVpTreeSingleNode* node;
+   double dist;  // distance between the query point and node's vantage point
+   size_t state; // see HClustVpTreeSingle::getNearestNeighborsFromMinRadius
+   size_t visited; // bit mask of children processed already
+
+   HClustVpTreeSingleStackItem(HClustVpTreeSingleNode* node) :
+         node(node), dist(INFINITY), state(0), visited(0) { }
+};
+
+
+struct HClustVpTreeSingleQueueItem
+{
+   HClustVpTreeSingleNode* node;
+   double lb; // lower bound for the distance between the query and node's elements
+   size_t path; // parent's entry in HClustVpTreeSingleContext::queuePath or SIZE_MAX
+
+   HClustVpTreeSingleQueueItem(HClustVpTreeSingleNode* node, double lb, size_t path=SIZE_MAX) :
+         node(node), lb(lb), path(path) { }
+
+   inline bool operator<( const HClustVpTreeSingleQueueItem& o ) const {
+      return lb > o.lb; // std::push_heap & co. will give a min-heap
+   }
+};
+
+
+struct HClustVpTreeSinglePathItem
+{
+   size_t parent; // SIZE_MAX for the root
+   double dist;   // distance between the query and the vantage point
+
+   HClustVpTreeSinglePathItem(size_t parent, double dist) :
+         parent(parent), dist(dist) { }
+};
+
+
+struct HClustVpTreeSingleLevelStats
+{
+   size_t visits;     // nodes visited during NN searches
+   size_t considered; // nodes their parents considered visiting
+   size_t scanned;    // elements of the leaves visited
+
+   HClustVpTreeSingleLevelStats() :
+         visits(0), considered(0), scanned(0) { }
+};
+
+
+struct HClustVpTreeSingleContext : public NNSearchContext
+{
+   std::vector<HClustVpTreeSingleStackItem> stack; // explicit traversal stack
+   std::vector<HClustVpTreeSingleQueueItem> queue; // for best-first search
+   std::vector<HClustVpTreeSinglePathItem> queuePath; // best-first: visited inner nodes
+   std::vector<double> qpivots; // distances between the query and the leaf's ancestor vantage points
+   std::vector<HClustVpTreeSingleLevelStats> levelStats; // empty unless opts->vpDiagnostics
+
+   HClustVpTreeSingleContext(HClustOptions* opts, size_t depth) :
+         NNSearchContext(opts),
+         stack(), queue(), queuePath(), qpivots(opts->vpPivots),
+         levelStats((opts->vpDiagnostics)?(depth+1):0) {
+      stack.reserve(depth+1);
+      queue.reserve(opts->vpFanout*depth+2);
    }
 };
 
@@ -64,50 +150,51 @@ class HClustVpTreeSingle : public HClustNNbasedSingle
 {
 protected:
    HClustVpTreeSingleNode* root;
+   size_t depth;
+   std::vector<HClustVpTreeSingleNode*> leaves;
+   size_t npivots;
+   std::vector<double> pivots;    // pivots[i*npivots+t] - distance between the leaf element at position i and its t-th nearest ancestor vantage point
+   std::vector<double> pivotRing; // used while building only
    // bool visitAll; // for testing only
 
    size_t chooseNewVantagePoint(size_t left, size_t right);
-   HClustVpTreeSingleNode* buildFromPoints(size_t left, size_t right, std::vector<double>& distances);
-
-   inline void getNearestNeighborsFromMinRadiusRecursive(HClustVpTreeSingleNode* node,
-      size_t index, size_t clusterIndex, double minR, std::priority_queue<double>& bestR, double& maxR, NNHeap& nnheap)
-   {
-      // search within (minR, maxR]
-      STOPIFNOT(node != NULL);
-      #ifdef GENERATE_STATS
-      #ifdef _OPENMP
-      #pragma omp atomic
-      #endif
-         ++stats.nodeVisit;
-      #endif
-
-      if (!prefetch && node->sameCluster && clusterIndex == ds.find_set(node->left))
-         return;
-
-      if (node->vpindex == SIZE_MAX) { // leaf
-         getNearestNeighborsFromMinRadiusRecursiveLeaf(node, index, clusterIndex,
-            minR, bestR, maxR, nnheap);
-      }
-      else {
-         getNearestNeighborsFromMinRadiusRecursiveNonLeaf(node, index, clusterIndex,
-            minR, bestR, maxR, nnheap);
-      }
+   HClustVpTreeSingleNode* buildFromPoints(size_t left, size_t right, std::vector<double>& distances, size_t level=0);
+
+   void getNearestNeighborsFromMinRadiusLeaf(HClustVpTreeSingleNode* node,
+      size_t index, size_t lowest, size_t clusterIndex, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap,
+      const double* qpivots=NULL, size_t nqpivots=0);
+
+   inline void getNearestNeighborsFromMinRadiusLeafElement(size_t i,
+         size_t index, size_t lowest, double minR, NNBestRadii& bestR, double& maxR, NNHeap& nnheap,
+         const double* qpivots, size_t nqpivots) {
+      if (i < lowest) return;
+      if (isPrunedByPivots(i, qpivots, nqpivots, minR, maxR)) return;
+      double dist2 = (*distance)(indices[index], indices[i]); // the slow part
+      if (dist2 > maxR || dist2 <= minR) return;
+      if (dist2 < bestR.top()) bestR.replaceTop(dist2);
+
+      nnheap.insert(i, dist2, maxR);
    }
 
-   void getNearestNeighborsFromMinRadiusRecursiveLeaf(HClustVpTreeSingleNode* node,
-      size_t index, size_t clusterIndex, double minR, std::priority_queue<double>& bestR, double& maxR, NNHeap& nnheap);
-   void getNearestNeighborsFromMinRadiusRecursiveNonLeaf(HClustVpTreeSingleNode* node,
-      size_t index, size_t clusterIndex, double minR, std::priority_queue<double>& bestR, double& maxR, NNHeap& nnheap);
+   inline bool isPrunedByPivots(size_t i, const double* qpivots, size_t nqpivots, double minR, double maxR) {
+      // LAESA-like: |d(q,p)-d(x,p)| <= d(q,x) <= d(q,p)+d(x,p)
+      const double* xpivots = &pivots[i*npivots];
+      for (size_t t=0; t<nqpivots; ++t) {
+         if (std::fabs(qpivots[t]-xpivots[t]) > maxR || qpivots[t]+xpivots[t] <= minR)
+            return true;
+      }
+      return false;
+   }
 
-   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNHeap& nnheap) {
-      std::priority_queue<double> bestR;
-      size_t minNN = (prefetch)?opts->minNNPrefetch:opts->minNNMerge;
-      for (size_t i=0; i<minNN; ++i) bestR.push(INFINITY);
+   virtual NNSearchContext* createSearchContext() {
+      return new HClustVpTreeSingleContext(opts, depth);
+   }
 
-      double maxR = INFINITY;
+   virtual void getNearestNeighborsFromMinRadius(size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx);
+   void getNearestNeighborsFromMinRadiusBestFirst(size_t index, size_t clusterIndex, double minR, NNSearchContext& ctx);
 
-      getNearestNeighborsFromMinRadiusRecursive(root, index, clusterIndex, minR, bestR, maxR, nnheap);
-   }
+   virtual void compactIndex();
+   virtual Rcpp::RObject getDiagnostics();
 
    void updateSameClusterFlag(HClustVpTreeSingleNode* node);
 